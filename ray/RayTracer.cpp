@@ -3,9 +3,15 @@
 #pragma warning(disable : 4786)
 
 #include "RayTracer.h"
+#include "WavefrontTracer.h"
+#include "scene/bvh.h"
+#include "scene/frustum.h"
 #include "scene/light.h"
+#include "scene/lighttree.h"
 #include "scene/material.h"
+#include "scene/morton.h"
 #include "scene/ray.h"
+#include "scene/raypacket.h"
 
 #include "parser/JsonParser.h"
 #include "parser/Parser.h"
@@ -29,14 +35,45 @@ extern TraceUI *traceUI;
 // set in the "trace single ray" mode in TraceGLWindow, for example.
 bool debugMode = false;
 
+namespace {
+
+// Neighbouring first pass hits on the same object count as an edge for
+// aaEdge() when their normals are further apart than this (about 25
+// degrees), or their depths differ by more than this fraction.
+const float AA_CREASE = 0.9f;
+const float AA_DEPTH_STEP = 0.1f;
+
+// A square of the anti-aliasing lattice waiting for aaImageBudget() to split
+// it: its window coordinates, its corner on the lattice and size, the
+// average of its corners, and how far that average might be from the truth.
+struct AACell {
+  double s1, s2, s3, s4;
+  int x1, y1, size;
+  glm::dvec3 average;
+  double error;
+  bool operator<(const AACell &other) const { return error < other.error; }
+};
+
+GSample describeHit(const isect &i, bool hit) {
+  GSample g;
+  if (hit) {
+    g.object = i.getObject();
+    g.normal = glm::vec3(glm::normalize(i.getN()));
+    g.depth = (float)i.getT();
+  }
+  return g;
+}
+
+} // anonymous namespace
+
 // Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates
 // (x,y), through the projection plane, and out into the scene. All we do is
 // enter the main ray-tracing method, getting things started by plugging in an
 // initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 
-glm::dvec3 RayTracer::trace(double x, double y) {
+template <int F> glm::dvec3 RayTracer::traceKernel(double x, double y) {
   // Clear out the ray cache in the scene for debugging purposes,
-  if (TraceUI::m_debug) {
+  if ((F & FEATURE_DEBUG) && settings.debug) {
     scene->clearIntersectCache();
   }
 
@@ -45,7 +82,7 @@ glm::dvec3 RayTracer::trace(double x, double y) {
   scene->getCamera().rayThrough(x, y, r);
   double dummy;
   glm::dvec3 ret =
-      traceRay(r, glm::dvec3(1.0, 1.0, 1.0), traceUI->getDepth(), dummy);
+      traceRayKernel<F>(r, glm::dvec3(1.0, 1.0, 1.0), settings.depth, dummy);
   ret = glm::clamp(ret, 0.0, 1.0);
   return ret;
 }
@@ -59,8 +96,11 @@ glm::dvec3 RayTracer::tracePixel(int i, int j) {
   double x = double(i) / double(buffer_width);
   double y = double(j) / double(buffer_height);
 
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  unsigned char *pixel = pixelAddress(i, j);
+  if (!gbuffer.empty())
+    gsample = &gbuffer[(size_t)j * buffer_width + i];
   col = trace(x, y);
+  keepFirstPass(i, j, col);
 
   pixel[0] = (int)(255.0 * col[0]);
   pixel[1] = (int)(255.0 * col[1]);
@@ -72,15 +112,23 @@ glm::dvec3 RayTracer::tracePixel(int i, int j) {
 
 // Do recursive ray tracing! You'll want to insert a lot of code here (or places
 // called from here) to handle reflection, refraction, etc etc.
-glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
-                               double &t) {
+template <int F>
+glm::dvec3 RayTracer::traceRayKernel(ray &r, const glm::dvec3 &thresh,
+                                     int depth, double &t) {
   isect i;
   glm::dvec3 colorC;
+  countRay(depth, false);
 #if VERBOSE
   std::cerr << "== current depth: " << depth << std::endl;
 #endif
 
-  if (scene->intersect(r, i)) {
+  bool hit = scene->intersect(
+      r, i, r.type() == ray::VISIBILITY ? primaryCut : nullptr);
+  if (gsample) {
+    *gsample = describeHit(i, hit);
+    gsample = nullptr;
+  }
+  if (hit) {
     // YOUR CODE HERE
 
     // An intersection occurred!  We've got work to do. For now, this code gets
@@ -93,55 +141,16 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
 
     // Time of flight
     t = i.getT();
-    // Intersection Normal
-    glm::dvec3 N = i.getN();
     // Material of the intersected object
     const Material &m = i.getMaterial();
 
-    // Ray intersection
-    glm::dvec3 Q = r.at(t);
     // local shading contribution
-    glm::dvec3 I = m.shade(scene.get(), r, i);
+    glm::dvec3 I = m.shadeKernel<(F & FEATURE_DEBUG) != 0,
+                                 (F & FEATURE_SHADOWS) != 0>(scene.get(), r, i);
 
     // End recursion if depth is 0
-    if (depth > 0) {
-      // Handle reflection
-      if (m.Refl()) {
-        glm::dvec3 d = r.getDirection();
-        glm::dvec3 Rd = glm::normalize(glm::reflect(d, N));
-        ray R(Q, Rd, r.getAtten(), ray::REFLECTION);
-        double t2;
-        I += m.kr(i) * traceRay(R, thresh, depth - 1, t2);
-      }
-
-      // Handle refraction
-      if (m.Trans()) {
-        glm::dvec3 d = r.getDirection();
-        double n_i, n_t;
-        glm::dvec3 Nnew;
-
-        if (glm::dot(d, N) > 0.0) {
-          // Ray is inside object, going into air
-          n_i = m.index(i);
-          n_t = 1.0;
-          Nnew = -N;
-        } else {
-          // Ray is outside object, going into material
-          n_i = 1.0;
-          n_t = m.index(i);
-          Nnew = N;
-        }
-
-        double eta = n_i / n_t;
-        glm::dvec3 Td = glm::refract(d, Nnew, eta);
-        if (glm::length(Td) > 0.0) { // Check for total internal reflection
-          Td = glm::normalize(Td);
-          ray T(Q, Td, r.getAtten(), ray::REFRACTION);
-          double t3;
-          I += m.kt(i) * traceRay(T, thresh, depth - 1, t3);
-        }
-      }
-    }
+    if ((F & (FEATURE_REFLECT | FEATURE_REFRACT)) && depth > 0)
+      traceSecondaryKernel<F>(r, i, thresh, depth, I);
 
     colorC = I;
   } else {
@@ -154,8 +163,8 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
     // traceUI->getCubeMap();
     //       Check traceUI->cubeMap() to see if cubeMap is loaded
     //       and enabled.
-	if (traceUI->cubeMap()) {
-		colorC = traceUI->getCubeMap()->getColor(r);
+	if ((F & FEATURE_CUBEMAP) && settings.cubeMap) {
+		colorC = settings.cubeMap->getColor(r, settings.filterWidth);
 	} else {
     colorC = glm::dvec3(0.0, 0.0, 0.0);
 	}
@@ -167,9 +176,306 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
   return colorC;
 }
 
+// Add the reflected and refracted contributions at hit i of ray r to I.
+template <int F>
+void RayTracer::traceSecondaryKernel(const ray &r, const isect &i,
+                                     const glm::dvec3 &thresh, int depth,
+                                     glm::dvec3 &I) {
+  // Intersection Normal
+  glm::dvec3 N = i.getN();
+  // Material of the intersected object
+  const Material &m = i.getMaterial();
+
+  // Ray intersection
+  glm::dvec3 Q = r.at(i.getT());
+
+  // Handle reflection, unless it would be too faint to matter
+  if ((F & FEATURE_REFLECT) && m.Refl()) {
+    glm::dvec3 kr = m.kr(i);
+    if (belowThreshold(thresh * kr)) {
+      countRay(depth - 1, true);
+    } else {
+      glm::dvec3 d = r.getDirection();
+      glm::dvec3 Rd = glm::normalize(glm::reflect(d, N));
+      ray R(Q, Rd, r.getAtten(), ray::REFLECTION);
+      double t2;
+      I += kr * traceRayKernel<F>(R, thresh * kr, depth - 1, t2);
+    }
+  }
+
+  // Handle refraction, likewise
+  if ((F & FEATURE_REFRACT) && m.Trans()) {
+    glm::dvec3 kt = m.kt(i);
+    glm::dvec3 d = r.getDirection();
+    double n_i, n_t;
+    glm::dvec3 Nnew;
+
+    if (glm::dot(d, N) > 0.0) {
+      // Ray is inside object, going into air
+      n_i = m.index(i);
+      n_t = 1.0;
+      Nnew = -N;
+    } else {
+      // Ray is outside object, going into material
+      n_i = 1.0;
+      n_t = m.index(i);
+      Nnew = N;
+    }
+
+    double eta = n_i / n_t;
+    glm::dvec3 Td = glm::refract(d, Nnew, eta);
+    if (glm::length(Td) > 0.0 && belowThreshold(thresh * kt)) {
+      countRay(depth - 1, true);
+    } else if (glm::length(Td) > 0.0) { // Check for total internal reflection
+      Td = glm::normalize(Td);
+      ray T(Q, Td, r.getAtten(), ray::REFRACTION);
+      double t3;
+      I += kt * traceRayKernel<F>(T, thresh * kt, depth - 1, t3);
+    }
+  }
+}
+
+// Trace the bw x bh block of pixels at (i0, j0) as one packet of camera rays,
+// with the same result as calling tracePixel() on each. Shadow rays go out as
+// packets as well; reflected and refracted rays have lost their coherence, so
+// those fall back to traceRay() one at a time.
+template <int F>
+void RayTracer::tracePacketKernel(int i0, int j0, int bw, int bh)
+{
+  RayPacket P(bw * bh, ray::VISIBILITY);
+  ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
+        ray::VISIBILITY);
+  for (int k = 0; k < P.size; k++)
+  {
+    int i = i0 + k % bw;
+    int j = j0 + k / bw;
+    if (i >= buffer_width || j >= buffer_height)
+      continue; // past the edge of the image: lane stays inactive
+    scene->getCamera().rayThrough(double(i) / double(buffer_width),
+                                  double(j) / double(buffer_height), r);
+    P.set(k, r.getPosition(), r.getDirection());
+    countRay(settings.depth, false);
+  }
+
+  isect hits[MAX_PACKET];
+  unsigned char found[MAX_PACKET];
+  scene->intersect(P, hits, found, primaryCut);
+  for (int k = 0; k < P.size && !gbuffer.empty(); k++)
+    if (P.active[k])
+      gbuffer[(size_t)(j0 + k / bw) * buffer_width + i0 + k % bw] =
+          describeHit(hits[k], found[k]);
+
+  // Same steps as Material::shade(), a light at a time across the packet
+  glm::dvec3 color[MAX_PACKET];
+  for (int k = 0; k < P.size; k++)
+  {
+    if (found[k])
+      color[k] = hits[k].getMaterial().shadeBase(scene.get(), hits[k]);
+    else if (P.active[k] && (F & FEATURE_CUBEMAP) && settings.cubeMap)
+      color[k] = settings.cubeMap->getColor(P.lane(k), settings.filterWidth);
+    else
+      color[k] = glm::dvec3(0.0, 0.0, 0.0);
+  }
+  const LightTree *tree = scene->lightTree();
+  for (const auto &pLight : tree ? tree->others() : scene->getAllLights())
+  {
+    LightSample sample[MAX_PACKET];
+    glm::dvec3 surfacePoint[MAX_PACKET];
+    glm::dvec3 shadowAtt[MAX_PACKET];
+    RayPacket S(P.size, ray::SHADOW);
+    for (int k = 0; k < P.size; k++)
+    {
+      if (!found[k])
+        continue;
+      r.setPosition(P.getPosition(k));
+      r.setDirection(P.getDirection(k));
+      hits[k].getMaterial().lightTerm(pLight, r, hits[k], sample[k]);
+      if (!(F & FEATURE_SHADOWS))
+      {
+        if (sample[k].facing)
+          color[k] += sample[k].contribution;
+      }
+      else if (sample[k].castShadow)
+      {
+        S.set(k, sample[k].origin, sample[k].direction);
+        surfacePoint[k] = r.at(hits[k]);
+      }
+      else
+      {
+        pLight->countUncast();
+        if (sample[k].facing)
+          color[k] += sample[k].contribution;
+      }
+    }
+    if (!S.any())
+      continue;
+    pLight->shadowAttenuationPacket(S, surfacePoint, shadowAtt);
+    for (int k = 0; k < P.size; k++)
+      if (S.active[k])
+        color[k] += sample[k].contribution * shadowAtt[k];
+  }
+  // Each lane picks its own lights from the tree, so take those a lane at
+  // a time
+  for (int k = 0; tree && k < P.size; k++)
+  {
+    if (!found[k])
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    LightSample samples[MAX_LIGHT_SAMPLES];
+    int n = hits[k].getMaterial().sampleLights(scene.get(), r, hits[k], samples);
+    for (int s = 0; s < n; s++)
+    {
+      const LightSample &sample = samples[s];
+      if ((F & FEATURE_SHADOWS) && sample.castShadow)
+      {
+        ray shadowRay(sample.origin, sample.direction, glm::dvec3(1.0),
+                      ray::SHADOW);
+        color[k] += sample.contribution *
+                    sample.light->shadowAttenuation(shadowRay, r.at(hits[k]));
+        continue;
+      }
+      if (F & FEATURE_SHADOWS)
+        sample.light->countUncast();
+      if (sample.facing)
+        color[k] += sample.contribution;
+    }
+  }
+
+  int depth = settings.depth;
+  for (int k = 0; k < P.size; k++)
+  {
+    if (!P.active[k])
+      continue;
+    if (found[k])
+    {
+      color[k] = glm::clamp(color[k], glm::dvec3(0.0), glm::dvec3(1.0));
+      if ((F & (FEATURE_REFLECT | FEATURE_REFRACT)) && depth > 0)
+      {
+        r.setPosition(P.getPosition(k));
+        r.setDirection(P.getDirection(k));
+        traceSecondaryKernel<F>(r, hits[k], glm::dvec3(1.0, 1.0, 1.0), depth,
+                                color[k]);
+      }
+    }
+    color[k] = glm::clamp(color[k], 0.0, 1.0);
+    keepFirstPass(i0 + k % bw, j0 + k / bw, color[k]);
+    setPixel(i0 + k % bw, j0 + k / bw, color[k]);
+  }
+}
+
+template <int F> RayTracer::Kernels RayTracer::kernelsFor() {
+  return {&RayTracer::traceKernel<F>, &RayTracer::traceRayKernel<F>,
+          &RayTracer::tracePacketKernel<F>};
+}
+
+const RayTracer::Kernels &RayTracer::kernelTable(int features) {
+  static const Kernels table[] = {
+      kernelsFor<0>(),  kernelsFor<1>(),  kernelsFor<2>(),  kernelsFor<3>(),
+      kernelsFor<4>(),  kernelsFor<5>(),  kernelsFor<6>(),  kernelsFor<7>(),
+      kernelsFor<8>(),  kernelsFor<9>(),  kernelsFor<10>(), kernelsFor<11>(),
+      kernelsFor<12>(), kernelsFor<13>(), kernelsFor<14>(), kernelsFor<15>(),
+      kernelsFor<16>(), kernelsFor<17>(), kernelsFor<18>(), kernelsFor<19>(),
+      kernelsFor<20>(), kernelsFor<21>(), kernelsFor<22>(), kernelsFor<23>(),
+      kernelsFor<24>(), kernelsFor<25>(), kernelsFor<26>(), kernelsFor<27>(),
+      kernelsFor<28>(), kernelsFor<29>(), kernelsFor<30>(), kernelsFor<31>()};
+  return table[features & FEATURE_ALL];
+}
+
+void RayTracer::reportStats(std::ostream &out) const {
+  if (!scene)
+    return;
+  int n = 0;
+  for (const Light *light : scene->getAllLights()) {
+    size_t queries, blocked, hits;
+    light->occluderStats(queries, blocked, hits);
+    out << "light " << n++ << ": " << queries << " shadow rays, " << blocked
+        << " blocked";
+    if (blocked)
+      out << ", " << hits << " (" << 100.0 * hits / blocked
+          << "%) by the cached occluder";
+    out << "; " << light->uncastShadows() << " not needed";
+    out << std::endl;
+  }
+  for (int level = 0; level < DEPTH_LEVELS; level++) {
+    size_t traced = 0, cut = 0;
+    for (int t = 0; t < MAX_THREADS; t++) {
+      traced += depthCounts[t].traced[level];
+      cut += depthCounts[t].cut[level];
+    }
+    if (traced || cut)
+      out << "depth " << level << (level == DEPTH_LEVELS - 1 ? "+" : "")
+          << ": " << traced << " rays traced, " << cut
+          << " under the threshold" << std::endl;
+  }
+  if (aaSamples) {
+    out << "anti-aliasing: " << aaSamples << " samples, " << aaTraced
+        << " traced (" << 100.0 * (aaSamples - aaTraced) / aaSamples
+        << "% reused)";
+    if (settings.aaBudget > 0)
+      out << ", budget " << settings.aaBudget;
+    if (!gbuffer.empty())
+      out << ", " << aaPixels << " of " << gbuffer.size()
+          << " pixels supersampled";
+    out << std::endl;
+  }
+  if (settings.interpolate)
+    out << "interpolation: " << interpolated << " of "
+        << (size_t)buffer_width * buffer_height << " pixels interpolated"
+        << std::endl;
+}
+
+void RayTracer::reportAccelerator(const BVHOptions &opt) const {
+  static const char *names[] = {"SAH", "LBVH", "SBVH"};
+  BVHOptions plain = opt;
+  plain.builder = BVH_SAH;
+  plain.treelets = false;
+  std::vector<BVHOptions> runs(1, opt);
+  if (opt != plain)
+    runs.push_back(plain);
+  for (const BVHOptions &o : runs) {
+    BVHStats s;
+    scene->measureAccelerator(o, s, 64);
+    std::cerr << "BVH " << names[std::max(0, std::min(o.builder, 2))]
+              << (o.treelets ? "+treelets" : "") << ": " << s.nodes
+              << " nodes, " << s.leaves << " leaves, " << s.references
+              << " refs for " << s.primitives << " prims, SAH cost "
+              << s.sahCost << ", " << s.nodesPerRay << " nodes and "
+              << s.primsPerRay << " prims per camera ray, built in "
+              << s.buildSeconds << "s" << std::endl;
+  }
+}
+
+void RayTracer::selectKernels() {
+  int f = 0;
+  if (settings.debug || debugMode)
+    f |= FEATURE_DEBUG;
+  if (settings.cubeMap)
+    f |= FEATURE_CUBEMAP;
+  if (settings.shadows)
+    f |= FEATURE_SHADOWS;
+  if (scene) {
+    // Leave out reflection and refraction when no material in the scene has
+    // any. Geometry that isn't a SceneObject could carry anything.
+    for (const Geometry *obj : scene->getAllObjects()) {
+      const SceneObject *so = dynamic_cast<const SceneObject *>(obj);
+      if (!so) {
+        f |= FEATURE_REFLECT | FEATURE_REFRACT;
+        break;
+      }
+      if (so->getMaterial().Refl())
+        f |= FEATURE_REFLECT;
+      if (so->getMaterial().Trans())
+        f |= FEATURE_REFRACT;
+    }
+  }
+  kernels = kernelTable(f);
+}
+
 RayTracer::RayTracer()
-    : scene(nullptr), buffer(0), thresh(0), buffer_width(0), buffer_height(0),
-      m_bBufferReady(false) {
+    : scene(nullptr), buffer(0), depthCounts(new DepthCounts[MAX_THREADS]()),
+      buffer_width(0), buffer_height(0), m_bBufferReady(false) {
+  kernels = kernelTable(FEATURE_ALL);
 }
 
 RayTracer::~RayTracer() {}
@@ -185,6 +491,10 @@ double RayTracer::aspectRatio() {
 }
 
 bool RayTracer::loadScene(const char *fn) {
+  return loadScene(fn, traceUI->bakeMeshesSw());
+}
+
+bool RayTracer::loadScene(const char *fn, bool bakeMeshes) {
   ifstream ifs(fn);
   if (!ifs) {
     string msg("Error: couldn't read scene file ");
@@ -248,10 +558,19 @@ bool RayTracer::loadScene(const char *fn) {
   if (!sceneLoaded())
     return false;
 
+  if (bakeMeshes)
+    scene->bakeTransforms();
+  scene->buildLightTree();
+
+  selectKernels();
   return true;
 }
 
 void RayTracer::traceSetup(int w, int h) {
+  traceSetup(w, h, traceUI->renderSettings());
+}
+
+void RayTracer::traceSetup(int w, int h, const RenderSettings &s) {
   size_t newBufferSize = w * h * 3;
   if (newBufferSize != buffer.size()) {
     bufferSize = newBufferSize;
@@ -263,19 +582,209 @@ void RayTracer::traceSetup(int w, int h) {
   m_bBufferReady = true;
 
   /*
-   * Sync with TraceUI
+   * Everything below reads these settings, never the UI
    */
 
-  threads = traceUI->getThreads();
-  block_size = traceUI->getBlockSize();
-  thresh = traceUI->getThreshold();
-  samples = traceUI->getSuperSamples();
-  aaThresh = traceUI->getAaThreshold();
+  settings = s;
+  firstPass.assign(settings.antiAlias ? (size_t)w * h : 0, glm::dvec3(0.0));
+  firstPassTraced.clear();
+  firstPassDone = false;
+  aaSamples = aaTraced = 0;
+  gbuffer.assign(settings.antiAlias && settings.aaEdges ? (size_t)w * h : 0,
+                 GSample());
+  aaPixels = 0;
+  interpolated = 0;
+  if (scene) {
+    scene->recordIntersections(settings.debug);
+    scene->cacheOccluders(settings.shadowCache);
+    scene->cullShadows(settings.shadowCutoff);
+    scene->sampleLights(settings.lightSamples);
+    for (Light *light : scene->getAllLights())
+      light->clearOccluders();
+    for (int t = 0; t < MAX_THREADS; t++)
+      depthCounts[t] = DepthCounts();
+    BVHOptions bvh;
+    bvh.builder = settings.bvhBuilder;
+    bvh.maxDepth = settings.treeDepth;
+    bvh.leafSize = settings.leafSize;
+    bvh.treelets = settings.bvhTreelets;
+    bvh.splitBudget = settings.bvhSplitBudget;
+    bvh.threads = settings.threads;
+    if (scene->buildAccelerator(settings.accelerate, bvh) && settings.bvhStats)
+      reportAccelerator(bvh);
+  }
+  selectKernels();
 
   // YOUR CODE HERE
   // FIXME: Additional initializations
 }
 
+void RayTracer::setDebug(bool debug) {
+  settings.debug = debug;
+  if (scene)
+    scene->recordIntersections(debug);
+  selectKernels();
+}
+
+namespace {
+
+// The cells of an nx x ny grid, in the order traceImage() visits them.
+std::vector<std::pair<int, int>> curveOrder(int nx, int ny, int order) {
+  std::vector<std::pair<int, int>> cells;
+  cells.reserve((size_t)nx * ny);
+  for (int y = 0; y < ny; y++)
+    for (int x = 0; x < nx; x++)
+      cells.emplace_back(x, y);
+  if (order == ORDER_SCANLINE)
+    return cells;
+
+  uint32_t n = 1;
+  while (n < (uint32_t)std::max(nx, ny))
+    n *= 2;
+  auto key = [&](const std::pair<int, int> &c) {
+    return order == ORDER_HILBERT ? hilbert2D(n, c.first, c.second)
+                                  : morton2D(c.first, c.second);
+  };
+  std::sort(cells.begin(), cells.end(),
+            [&](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+              return key(a) < key(b);
+            });
+  return cells;
+}
+
+} // anonymous namespace
+
+// Same as the plain loop in traceImage, but hands whole bands of rows to the
+// wavefront engine so every stage works on a large batch of rays at once.
+void RayTracer::traceImageWavefront(int w, int h, bool lastPass)
+{
+  WavefrontTracer engine(*scene, settings.depth, settings.cubeMap,
+                         settings.threads, settings.sortSecondary,
+                         settings.threshold, settings.filterWidth,
+                         settings.shadows);
+
+  // Keep each batch around 64K camera rays.
+  int band = std::max(1, 65536 / std::max(1, w));
+  std::vector<glm::dvec2> samples;
+  std::vector<glm::dvec3> colors;
+  std::vector<isect> firstHits;
+  for (int j0 = 0; j0 < h; j0 += band)
+  {
+    int j1 = std::min(h, j0 + band);
+    samples.clear();
+    for (int j = j0; j < j1; j++)
+      for (int i = 0; i < w; i++)
+        samples.emplace_back(double(i) / double(buffer_width),
+                             double(j) / double(buffer_height));
+
+    engine.trace(samples, colors, gbuffer.empty() ? nullptr : &firstHits);
+
+    size_t k = 0;
+    for (int j = j0; j < j1; j++)
+      for (int i = 0; i < w; i++) {
+        if (!gbuffer.empty())
+          gbuffer[(size_t)j * buffer_width + i] =
+              describeHit(firstHits[k], firstHits[k].getObject() != nullptr);
+        keepFirstPass(i, j, colors[k]);
+        setPixel(i, j, colors[k++]);
+      }
+    if (rowsDone && lastPass)
+      rowsDone(j0, j1);
+  }
+
+  // The engine's rounds are the recursion levels
+  for (size_t n = 0; n < engine.tracedPerRound().size(); n++) {
+    size_t level = std::min<size_t>(n, DEPTH_LEVELS - 1);
+    depthCounts[0].traced[level] += engine.tracedPerRound()[n];
+    depthCounts[0].cut[level] += engine.cutPerRound()[n];
+  }
+}
+
+// A preview: trace only the corners of each blockSize square of pixels and
+// fill in the ones between where the corners agree to within threshold (the
+// same setting that cuts off faint secondary rays). Blocks that don't are
+// quartered until they do or every pixel is traced. Filled-in pixels are
+// left out of the first pass, so an AA pass traces them afresh.
+void RayTracer::traceImageInterpolated(int w, int h, bool lastPass)
+{
+  int block = std::max(1, settings.blockSize);
+  std::vector<glm::dvec3> colors((size_t)w * h);
+  std::vector<char> traced((size_t)w * h, 0);
+
+  // Corners are shared, so the last block in a row or column ends on the
+  // last pixel rather than past the edge of the image.
+  for (int j0 = 0; j0 < h; j0 += block)
+  {
+    int j1 = std::min(j0 + block, h - 1);
+    for (int i0 = 0; i0 < w; i0 += block)
+      interpolateBlock(i0, j0, std::min(i0 + block, w - 1), j1, colors,
+                       traced);
+    // Row j0 + block is filled again by the next band
+    if (rowsDone && lastPass)
+      rowsDone(j0, std::min(j0 + block, h));
+  }
+  interpolated = std::count(traced.begin(), traced.end(), 0);
+  if (!firstPass.empty())
+    firstPassTraced.swap(traced);
+}
+
+void RayTracer::interpolateBlock(int i0, int j0, int i1, int j1,
+                                 std::vector<glm::dvec3> &colors,
+                                 std::vector<char> &traced)
+{
+  int xs[2] = {i0, i1}, ys[2] = {j0, j1};
+  glm::dvec3 c[2][2];
+  for (int b = 0; b < 2; b++)
+    for (int a = 0; a < 2; a++) {
+      size_t k = (size_t)ys[b] * buffer_width + xs[a];
+      if (!traced[k]) {
+        colors[k] = tracePixel(xs[a], ys[b]);
+        traced[k] = 1;
+      }
+      c[b][a] = colors[k];
+    }
+  if (i1 - i0 <= 1 && j1 - j0 <= 1)
+    return;
+
+  double diff = 0.0;
+  const glm::dvec3 *flat = &c[0][0];
+  for (int a = 0; a < 4; a++)
+    for (int b = a + 1; b < 4; b++)
+      diff = std::max(diff, glm::length(flat[a] - flat[b]));
+
+  if (diff >= settings.threshold)
+  {
+    // Halve whichever sides are still more than a pixel long
+    int im = (i0 + i1) / 2, jm = (j0 + j1) / 2;
+    int xcut[3] = {i0, im, i1}, ycut[3] = {j0, jm, j1};
+    int nx = i1 - i0 > 1 ? 2 : 1, ny = j1 - j0 > 1 ? 2 : 1;
+    if (nx == 1)
+      xcut[1] = i1;
+    if (ny == 1)
+      ycut[1] = j1;
+    for (int b = 0; b < ny; b++)
+      for (int a = 0; a < nx; a++)
+        interpolateBlock(xcut[a], ycut[b], xcut[a + 1], ycut[b + 1], colors,
+                         traced);
+    return;
+  }
+
+  // Bilinear between the corners. Pixels traced already, by this block or a
+  // neighbour that was split, keep their own colour.
+  for (int j = j0; j <= j1; j++)
+    for (int i = i0; i <= i1; i++) {
+      size_t k = (size_t)j * buffer_width + i;
+      if (traced[k])
+        continue;
+      double u = double(i - i0) / std::max(1, i1 - i0);
+      double v = double(j - j0) / std::max(1, j1 - j0);
+      glm::dvec3 color = (1 - v) * ((1 - u) * c[0][0] + u * c[0][1]) +
+                         v * ((1 - u) * c[1][0] + u * c[1][1]);
+      colors[k] = color;
+      setPixel(i, j, color);
+    }
+}
+
 /*
  * RayTracer::traceImage
  *
@@ -291,14 +800,93 @@ void RayTracer::traceImage(int w, int h)
   // Always call traceSetup before rendering anything.
   traceSetup(w, h);
 
-  // Loop through every pixel and call tracePixel on it to render the entire image
-  for (int i = 0; i < w; i++) 
+  // Loop through every pixel and call tracePixel on it to render the entire image.
+  // Go a row at a time so finished rows can be handed to the image writer while
+  // the rest of the frame is still tracing (unless an AA pass will redo them).
+  bool lastPass = !settings.antiAlias;
+  if (settings.interpolate)
+  {
+    traceImageInterpolated(w, h, lastPass);
+    firstPassDone = !firstPass.empty();
+    m_bBufferReady = true;
+    return;
+  }
+  if (settings.wavefront)
+  {
+    traceImageWavefront(w, h, lastPass);
+    firstPassDone = !firstPass.empty();
+    m_bBufferReady = true;
+    return;
+  }
+
+  // With packets on, pixels go in 2x2, 4x2 or 4x4 blocks instead.
+  int packet = settings.debug ? 1 : settings.packetSize;
+  int bw = packet >= 8 ? 4 : packet >= 4 ? 2 : 1;
+  int bh = packet >= 16 ? 4 : packet >= 4 ? 2 : 1;
+
+  // With frustum culling or a curve order on, work through square tiles (a
+  // whole number of blocks). Otherwise a tile is a full-width strip of one
+  // block's height, visited left to right and top to bottom as before.
+  bool cull = settings.frustumCull && !settings.debug;
+  int order = settings.debug ? ORDER_SCANLINE : settings.pixelOrder;
+  bool square = cull || order != ORDER_SCANLINE;
+  int tile = std::max(1, settings.tileSize);
+  int tileW = square ? (tile + bw - 1) / bw * bw : w;
+  int tileH = square ? (tile + bh - 1) / bh * bh : bh;
+  int tilesX = (w + tileW - 1) / tileW;
+  int tilesY = (h + tileH - 1) / tileH;
+
+  // Along a curve, pixels land in a tile-major buffer first and each strip
+  // of tiles is copied out to the row-major buffer once it is complete.
+  if (order != ORDER_SCANLINE)
+  {
+    tileBuffer.assign((size_t)tilesX * tilesY * tileW * tileH * 3, 0);
+    tileMajorW = tileW;
+    tileMajorH = tileH;
+    tilesAcross = tilesX;
+  }
+
+  std::vector<std::pair<int, int>> tiles = curveOrder(tilesX, tilesY, order);
+  std::vector<std::pair<int, int>> blocks =
+      curveOrder((tileW + bw - 1) / bw, (tileH + bh - 1) / bh, order);
+  std::vector<int> stripTiles(tilesY, 0);
+
+  for (const auto &t : tiles)
   {
-	  for (int j = 0; j < h; j++) 
+    int i0 = t.first * tileW, j0 = t.second * tileH;
+    int i1 = std::min(w, i0 + tileW), j1 = std::min(h, j0 + tileH);
+    if (cull)
+    {
+      // Pad by half a pixel so rounding never drops a visible object.
+      Frustum frustum(scene->getCamera(), (i0 - 0.5) / buffer_width,
+                      (j0 - 0.5) / buffer_height, (i1 - 0.5) / buffer_width,
+                      (j1 - 0.5) / buffer_height);
+      if (scene->cull(frustum, tileCut))
+        primaryCut = &tileCut;
+    }
+    for (const auto &b : blocks)
+    {
+      int i = i0 + b.first * bw, j = j0 + b.second * bh;
+      if (i >= i1 || j >= j1)
+        continue;
+      if (packet >= 4)
+        tracePacket(i, j, bw, bh);
+      else
+        tracePixel(i, j);
+    }
+    primaryCut = nullptr;
+
+    if (++stripTiles[t.second] == tilesX)
     {
-		tracePixel(i, j);
-	  }
+      if (tileMajorW)
+        scatterStrip(t.second);
+      if (rowsDone && lastPass)
+        rowsDone(j0, j1);
+    }
   }
+  tileMajorW = tileMajorH = 0;
+  std::vector<unsigned char>().swap(tileBuffer);
+  firstPassDone = !firstPass.empty();
 
     // Triggers the image to actually show all rendered pixels (it's ready to be shown to the user)
     m_bBufferReady = true;
@@ -309,16 +897,27 @@ int RayTracer::aaImage()
 {
   
   // Ensure we actually have a scene to perform this on to avoid problems
+  if (sceneLoaded() && settings.aaBudget > 0)
+  {
+    aaImageBudget();
+    return 1;
+  }
   if (sceneLoaded())
   {
 
     // Initialize a variable for the maximum number of times we can call our recursive function (so we don't go infinitely)
-    int n = samples;
+    // (16 levels is already 65536 lattice steps per pixel)
+    int n = std::max(0, std::min(settings.superSamples, 16));
+
+    // Every corner the recursion can visit lies on a lattice n halvings finer than the pixels,
+    // so samples are remembered by lattice point and traced only once
+    aaScale = 1 << n;
+    aaLattice.clear();
 
-    // Loop over the entire image (as we will do this for all pixels)
-    for (int i = 0; i < buffer_width; i++) 
+    // Loop over the entire image (as we will do this for all pixels), a row at a time
+    for (int j = 0; j < buffer_height; j++) 
     {
-	    for (int j = 0; j < buffer_height; j++) 
+	    for (int i = 0; i < buffer_width; i++) 
       {
       // Divide the pixel into 4 rays (the corners)
 
@@ -337,12 +936,41 @@ int RayTracer::aaImage()
       double p3 = (i+1) / static_cast<double>(buffer_width);
       double p4 = (j+1) / static_cast<double>(buffer_height);
 
+      // A preview only guessed some pixels' colours and has no hits for them, so trace those
+      // corners for real first (each is redrawn by the time this pass is done)
+      if (firstPassDone && !gbuffer.empty())
+        for (int c = 0; c < 4; c++)
+          traceFirstPass(i + c % 2, j + c / 2);
+
+      // With aa_edges on, pixels the first pass shows no edge or contrast across are just the average
+      // of their corners (all traced already), and ones on a geometric edge are split at least once
+      // even if the colours agree
+      bool geometric = false;
+      int levels = n;
+      if (firstPassDone && !gbuffer.empty() && !aaEdge(i, j, geometric))
+        levels = 0;
+      else
+        aaPixels++;
+
       // Call recursion to get our final pixel color, ensure that we don't go past the specificed depth the user set
-      glm::dvec3 pixelColor = subsectionsAA(p1, p2, p3, p4, n);
+      glm::dvec3 pixelColor = subsectionsAA(p1, p2, p3, p4, i * aaScale, j * aaScale, aaScale, levels, geometric);
       setPixel(i, j, pixelColor);
       
 	    }
+      if (rowsDone)
+        rowsDone(j, j + 1);
+
+      // Only the points along the top of this row are shared with the next one
+      int top = (j + 1) * aaScale;
+      for (auto it = aaLattice.begin(); it != aaLattice.end();)
+      {
+        if ((int)(it->first & 0xffffffff) < top)
+          it = aaLattice.erase(it);
+        else
+          ++it;
+      }
     }
+    aaLattice.clear();
 
     // Triggers the image to actually show all rendered pixels (it's ready to be shown to the user, now with the adaptive anti-aliasing)
     m_bBufferReady = true;
@@ -359,15 +987,19 @@ int RayTracer::aaImage()
 }
 
 // Implementing Adaptive Anti-Aliasing - the function we call to do recursion
-glm::dvec3 RayTracer::subsectionsAA(double s1, double s2, double s3, double s4, int depth)
+glm::dvec3 RayTracer::subsectionsAA(double s1, double s2, double s3, double s4,
+                                    int x1, int y1, int size, int depth, bool split)
 {
 
   // Get the color of each of these pixels to determine if we will need to break it up any further
   // (s1,s2) = bottomLeft, (s3,s2) = bottomRight, (s1,s4) = topLeft, (s3,s4) = topRight
-  glm::dvec3 bottomLeft = trace(s1,s2);
-  glm::dvec3 bottomRight = trace(s3,s2);
-  glm::dvec3 topLeft = trace(s1,s4);
-  glm::dvec3 topRight = trace(s3,s4);
+  // Corners shared with a neighbouring cell or pixel come back from the lattice instead
+  int x3 = x1 + size;
+  int y4 = y1 + size;
+  glm::dvec3 bottomLeft = aaSample(s1, s2, x1, y1);
+  glm::dvec3 bottomRight = aaSample(s3, s2, x3, y1);
+  glm::dvec3 topLeft = aaSample(s1, s4, x1, y4);
+  glm::dvec3 topRight = aaSample(s3, s4, x3, y4);
 
   // Compare the color differences to find where the greatest difference lies (ie where we need to divide more)
   double colorDiff1 = glm::length(glm::abs(bottomLeft-bottomRight));
@@ -379,7 +1011,7 @@ glm::dvec3 RayTracer::subsectionsAA(double s1, double s2, double s3, double s4,
 
   // Compare this difference to our threshold to determine if it's necessary to break it up further 
   // Also ensure that we have not gone deeper than what our samples value says
-  if ((maxDiff >= aaThresh) && (depth > 0))
+  if ((maxDiff >= settings.aaThreshold || split) && (depth > 0))
   {
     // Decrement depth since we are going one deeper
     depth--;
@@ -398,10 +1030,11 @@ glm::dvec3 RayTracer::subsectionsAA(double s1, double s2, double s3, double s4,
     double midY = (s2+s4)/2;
 
     // Call the recursive function for each of these newly broken up sections
-    glm::dvec3 final1 = subsectionsAA(s1, s2, midX, midY, depth);
-    glm::dvec3 final2 = subsectionsAA(midX, s2, s3, midY, depth);
-    glm::dvec3 final3 = subsectionsAA(s1, midY, midX, s4, depth);
-    glm::dvec3 final4 = subsectionsAA(midX, midY, s3, s4, depth);
+    int half = size / 2;
+    glm::dvec3 final1 = subsectionsAA(s1, s2, midX, midY, x1, y1, half, depth);
+    glm::dvec3 final2 = subsectionsAA(midX, s2, s3, midY, x1 + half, y1, half, depth);
+    glm::dvec3 final3 = subsectionsAA(s1, midY, midX, s4, x1, y1 + half, half, depth);
+    glm::dvec3 final4 = subsectionsAA(midX, midY, s3, s4, x1 + half, y1 + half, half, depth);
 
     // Return the final color based on the average of all these recursed subsections
     glm::dvec3 subsectionPixelColor = (final1 + final2 + final3 + final4) / 4.0;
@@ -417,6 +1050,166 @@ glm::dvec3 RayTracer::subsectionsAA(double s1, double s2, double s3, double s4,
   }
 }
 
+void RayTracer::aaImageBudget()
+{
+  int n = std::max(0, std::min(settings.superSamples, 16));
+  aaScale = 1 << n;
+  aaLattice.clear();
+  std::vector<glm::dvec3> pixels((size_t)buffer_width * buffer_height);
+  std::vector<char> estimated(pixels.size(), 0);
+  std::priority_queue<AACell> cells;
+
+  // Every new trace counts against the budget, so anything that would take it over is skipped.
+  // A lattice point costs a trace unless traceImage() or an earlier cell already has it.
+  size_t budget = (size_t)settings.aaBudget, start = aaTraced;
+  auto fresh = [&](int lx, int ly) {
+    if (firstPassAt(lx, ly))
+      return 0;
+    return aaLattice.count((uint64_t)lx << 32 | (uint32_t)ly) ? 0 : 1;
+  };
+  auto affordable = [&](int cost) { return aaTraced - start + cost <= budget; };
+
+  // Sample a cell's corners, and queue it if it can still be split. Its error is the
+  // largest difference between two corners, scaled by the share of its pixel it covers.
+  auto visit = [&](AACell cell) {
+    glm::dvec3 c[4] = {aaSample(cell.s1, cell.s2, cell.x1, cell.y1),
+                       aaSample(cell.s3, cell.s2, cell.x1 + cell.size, cell.y1),
+                       aaSample(cell.s1, cell.s4, cell.x1, cell.y1 + cell.size),
+                       aaSample(cell.s3, cell.s4, cell.x1 + cell.size, cell.y1 + cell.size)};
+    double diff = 0.0;
+    for (int a = 0; a < 4; a++)
+      for (int b = a + 1; b < 4; b++)
+        diff = std::max(diff, glm::length(c[a] - c[b]));
+    double share = (double)cell.size / aaScale;
+    cell.average = (c[0] + c[1] + c[2] + c[3]) / 4.0;
+    cell.error = diff * share * share;
+    if (cell.size > 1 && cell.error > 0.0)
+      cells.push(cell);
+    return cell.average;
+  };
+
+  // The estimate to start from is each pixel's corner average, which only needs the first pass
+  // (and the row and column of samples past the far edges of the image, or every corner without
+  // one). A pixel whose corners don't fit in the budget keeps the colour traceImage() gave it.
+  for (int j = 0; j < buffer_height; j++)
+  {
+    for (int i = 0; i < buffer_width; i++)
+    {
+      int x = i * aaScale, y = j * aaScale;
+      if (!affordable(fresh(x, y) + fresh(x + aaScale, y) + fresh(x, y + aaScale) +
+                      fresh(x + aaScale, y + aaScale)))
+        continue;
+      AACell cell = {i / (double)buffer_width, j / (double)buffer_height,
+                     (i + 1) / (double)buffer_width, (j + 1) / (double)buffer_height,
+                     x, y, aaScale, glm::dvec3(0.0), 0.0};
+      pixels[(size_t)j * buffer_width + i] = visit(cell);
+      estimated[(size_t)j * buffer_width + i] = 1;
+    }
+  }
+
+  // Then split the worst cell left, swapping its average in the pixel for the average of its
+  // quarters, until the budget runs out or every cell left is flat or as small as the lattice
+  // goes. A split needs up to five new points; cells that need more than is left are passed over.
+  while (aaTraced - start < budget && !cells.empty())
+  {
+    AACell cell = cells.top();
+    cells.pop();
+    int half = cell.size / 2;
+    if (!affordable(fresh(cell.x1 + half, cell.y1) + fresh(cell.x1, cell.y1 + half) +
+                    fresh(cell.x1 + half, cell.y1 + half) +
+                    fresh(cell.x1 + cell.size, cell.y1 + half) +
+                    fresh(cell.x1 + half, cell.y1 + cell.size)))
+      continue;
+    double midX = (cell.s1 + cell.s3) / 2;
+    double midY = (cell.s2 + cell.s4) / 2;
+    AACell quarters[4] = {
+        {cell.s1, cell.s2, midX, midY, cell.x1, cell.y1, half, glm::dvec3(0.0), 0.0},
+        {midX, cell.s2, cell.s3, midY, cell.x1 + half, cell.y1, half, glm::dvec3(0.0), 0.0},
+        {cell.s1, midY, midX, cell.s4, cell.x1, cell.y1 + half, half, glm::dvec3(0.0), 0.0},
+        {midX, midY, cell.s3, cell.s4, cell.x1 + half, cell.y1 + half, half, glm::dvec3(0.0), 0.0}};
+    glm::dvec3 refined(0.0);
+    for (const AACell &quarter : quarters)
+      refined += visit(quarter);
+    double share = (double)cell.size / aaScale;
+    glm::dvec3 &pixel = pixels[(size_t)(cell.y1 / aaScale) * buffer_width + cell.x1 / aaScale];
+    pixel += (refined / 4.0 - cell.average) * share * share;
+  }
+  aaLattice.clear();
+
+  for (int j = 0; j < buffer_height; j++)
+    for (int i = 0; i < buffer_width; i++)
+      if (estimated[(size_t)j * buffer_width + i])
+        setPixel(i, j, pixels[(size_t)j * buffer_width + i]);
+  if (rowsDone)
+    rowsDone(0, buffer_height);
+  m_bBufferReady = true;
+}
+
+bool RayTracer::aaEdge(int i, int j, bool &geometric) const
+{
+  // The pixel's cell runs from its own sample to the ones to the right and above. The first pass
+  // has nothing past the last row and column, so leave those pixels to the colour test.
+  geometric = false;
+  if (i + 1 >= buffer_width || j + 1 >= buffer_height)
+    return true;
+  size_t corner[4] = {(size_t)j * buffer_width + i, (size_t)j * buffer_width + i + 1,
+                      (size_t)(j + 1) * buffer_width + i, (size_t)(j + 1) * buffer_width + i + 1};
+
+  bool contrast = false;
+  for (int a = 0; a < 4; a++)
+  {
+    for (int b = a + 1; b < 4; b++)
+    {
+      const GSample &ga = gbuffer[corner[a]];
+      const GSample &gb = gbuffer[corner[b]];
+      // A silhouette or a change of object, or the same object folding or stepping away
+      if (ga.object != gb.object)
+        geometric = true;
+      else if (ga.object && (glm::dot(ga.normal, gb.normal) < AA_CREASE ||
+                             std::abs(ga.depth - gb.depth) > AA_DEPTH_STEP * std::max(ga.depth, gb.depth)))
+        geometric = true;
+      // The same colour test subsectionsAA() makes
+      if (glm::length(glm::abs(firstPass[corner[a]] - firstPass[corner[b]])) >= settings.aaThreshold)
+        contrast = true;
+    }
+  }
+  return geometric || contrast;
+}
+
+void RayTracer::traceFirstPass(int i, int j)
+{
+  if (i >= buffer_width || j >= buffer_height || firstPassTraced.empty())
+    return;
+  size_t k = (size_t)j * buffer_width + i;
+  if (firstPassTraced[k])
+    return;
+  aaSamples++;
+  aaTraced++;
+  tracePixel(i, j);
+  firstPassTraced[k] = 1;
+}
+
+glm::dvec3 RayTracer::aaSample(double x, double y, int lx, int ly)
+{
+  aaSamples++;
+
+  // A pixel's own corner was traced by traceImage() (the far edges of the image were not)
+  if (const glm::dvec3 *traced = firstPassAt(lx, ly))
+    return *traced;
+
+  uint64_t key = (uint64_t)lx << 32 | (uint32_t)ly;
+  auto it = aaLattice.find(key);
+  if (it != aaLattice.end())
+    return it->second;
+
+  // Every path to a lattice point halves the same pair of coordinates, so (x, y) is
+  // always the same and the colour is exactly what tracing it again would give
+  aaTraced++;
+  glm::dvec3 color = trace(x, y);
+  aaLattice.emplace(key, color);
+  return color;
+}
+
 // We aren't utilizing this function since we aren't using threads
 bool RayTracer::checkRender() {
   return true;
@@ -434,9 +1227,35 @@ glm::dvec3 RayTracer::getPixel(int i, int j) {
 }
 
 void RayTracer::setPixel(int i, int j, glm::dvec3 color) {
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  unsigned char *pixel = pixelAddress(i, j);
 
   pixel[0] = (int)(255.0 * color[0]);
   pixel[1] = (int)(255.0 * color[1]);
   pixel[2] = (int)(255.0 * color[2]);
 }
+
+// Where pixel (i, j) is being written: the row-major buffer, or its slot in
+// the tile-major buffer while traceImage() is filling that.
+unsigned char *RayTracer::pixelAddress(int i, int j) {
+  if (!tileMajorW)
+    return buffer.data() + (i + j * buffer_width) * 3;
+  int tx = i / tileMajorW, ty = j / tileMajorH;
+  size_t tileIndex = (size_t)ty * tilesAcross + tx;
+  size_t offset = (j - ty * tileMajorH) * tileMajorW + (i - tx * tileMajorW);
+  return tileBuffer.data() +
+         (tileIndex * tileMajorW * tileMajorH + offset) * 3;
+}
+
+// Copy the finished strip of tiles in tile row ty to the row-major buffer.
+void RayTracer::scatterStrip(int ty) {
+  int j0 = ty * tileMajorH;
+  int j1 = std::min(buffer_height, j0 + tileMajorH);
+  for (int tx = 0; tx < tilesAcross; tx++) {
+    int i0 = tx * tileMajorW;
+    int n = std::min(buffer_width, i0 + tileMajorW) - i0;
+    for (int j = j0; j < j1; j++) {
+      const unsigned char *src = pixelAddress(i0, j);
+      std::copy(src, src + n * 3, buffer.data() + (i0 + j * buffer_width) * 3);
+    }
+  }
+}
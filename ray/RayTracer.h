@@ -5,15 +5,58 @@
 
 // The main ray tracer.
 
+#include "RenderSettings.h"
+#include "scene/bvh.h"
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
+#include <algorithm>
+#include <functional>
 #include <glm/vec3.hpp>
+#include <iosfwd>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <time.h>
+#include <unordered_map>
+#include <vector>
 
 class Scene;
+class SceneObject;
+
+// Orders traceImage() can visit tiles, and pixels within a tile, in.
+enum PixelOrder { ORDER_SCANLINE = 0, ORDER_MORTON = 1, ORDER_HILBERT = 2 };
+
+// Features the trace kernels are specialized on. A kernel built without a
+// feature has the code for it compiled out.
+enum TraceFeature {
+  FEATURE_DEBUG = 1,    // debugMode output and the intersection cache
+  FEATURE_CUBEMAP = 2,  // misses look up the cube map
+  FEATURE_SHADOWS = 4,  // cast shadow rays
+  FEATURE_REFLECT = 8,  // follow reflected rays
+  FEATURE_REFRACT = 16, // follow refracted rays
+  FEATURE_ALL = 31
+};
+
+// Recursion levels RayTracer::reportStats() counts rays at. Level 0 is the
+// camera rays; anything deeper than the last level is counted there.
+const int DEPTH_LEVELS = 16;
+
+// One thread's ray counts by recursion level.
+struct alignas(64) DepthCounts {
+  size_t traced[DEPTH_LEVELS]; // rays followed
+  size_t cut[DEPTH_LEVELS];    // reflected or refracted rays left untraced
+                               // because their weight was under threshold
+};
+
+// What the camera ray through a pixel hit in the first pass, so aaImage()
+// can find silhouettes and creases without tracing anything more.
+struct GSample {
+  const SceneObject *object = nullptr; // null for a miss
+  glm::vec3 normal = glm::vec3(0.0f);
+  float depth = 0.0f;
+};
+
 class Pixel {
 public:
   Pixel(int i, int j, unsigned char *ptr) : ix(i), jy(j), value(ptr) {}
@@ -30,8 +73,14 @@ public:
   ~RayTracer();
 
   glm::dvec3 tracePixel(int i, int j);
+  // thresh is the weight r's colour will carry in the pixel, the product of
+  // the kr and kt terms along its path. Reflected and refracted rays whose
+  // weight would fall below the threshold setting in every channel are not
+  // traced.
   glm::dvec3 traceRay(ray &r, const glm::dvec3 &thresh, int depth,
-                      double &length);
+                      double &length) {
+    return (this->*kernels.traceRay)(r, thresh, depth, length);
+  }
 
   glm::dvec3 getPixel(int i, int j);
   void setPixel(int i, int j, glm::dvec3 color);
@@ -40,15 +89,40 @@ public:
 
   void traceImage(int w, int h);
   int aaImage();
-  glm::dvec3 subsectionsAA(double s1, double s2, double s3, double s4, int depth);
+  // (x1, y1) and (x3, y4) are the corners of the cell on the sample lattice
+  // aaImage() sets up, size = x3 - x1 = y4 - y1 lattice steps across.
+  // With split set the cell is subdivided once even if its corners agree.
+  glm::dvec3 subsectionsAA(double s1, double s2, double s3, double s4,
+                           int x1, int y1, int size, int depth,
+                           bool split = false);
   bool checkRender();
   void waitRender();
 
+  // Size the buffer and take a snapshot of the render settings; the plain
+  // version takes them from traceUI.
   void traceSetup(int w, int h);
+  void traceSetup(int w, int h, const RenderSettings &s);
+  const RenderSettings &getSettings() const { return settings; }
+
+  // Turn intersection recording for the debugging view on or off without
+  // going through traceSetup() (which clears the image).
+  void setDebug(bool debug);
+
+  // Counters gathered during the last render, one line per item.
+  void reportStats(std::ostream &out) const;
 
+  // Load a scene and, if bakeMeshes, move mesh vertices into world space;
+  // the plain version takes the flag from traceUI.
   bool loadScene(const char *fn);
+  bool loadScene(const char *fn, bool bakeMeshes);
   bool sceneLoaded() { return scene != 0; }
 
+  // Called with [y0, y1) as soon as those buffer rows hold their final
+  // colours, so an image writer can start encoding before the frame is done.
+  void setRowsDoneCallback(std::function<void(int, int)> cb) {
+    rowsDone = std::move(cb);
+  }
+
   void setReady(bool ready) { m_bBufferReady = ready; }
   bool isReady() const { return m_bBufferReady; }
 
@@ -57,19 +131,132 @@ public:
   bool stopTrace;
 
 private:
-  glm::dvec3 trace(double x, double y);
+  glm::dvec3 trace(double x, double y) { return (this->*kernels.trace)(x, y); }
+  void tracePacket(int i0, int j0, int bw, int bh) {
+    (this->*kernels.tracePacket)(i0, j0, bw, bh);
+  }
+
+  // The kernels behind trace(), traceRay() and tracePacket(), one
+  // instantiation per combination of TraceFeature bits.
+  template <int F> glm::dvec3 traceKernel(double x, double y);
+  template <int F>
+  glm::dvec3 traceRayKernel(ray &r, const glm::dvec3 &thresh, int depth,
+                            double &length);
+  template <int F>
+  void traceSecondaryKernel(const ray &r, const isect &i,
+                            const glm::dvec3 &thresh, int depth,
+                            glm::dvec3 &I);
+  template <int F> void tracePacketKernel(int i0, int j0, int bw, int bh);
+
+  struct Kernels {
+    glm::dvec3 (RayTracer::*trace)(double, double);
+    glm::dvec3 (RayTracer::*traceRay)(ray &, const glm::dvec3 &, int,
+                                      double &);
+    void (RayTracer::*tracePacket)(int, int, int, int);
+  };
+  template <int F> static Kernels kernelsFor();
+  static const Kernels &kernelTable(int features);
+
+  // Pick the kernels for the current settings and scene. Called whenever
+  // either changes, so the choice is made once per render, not per ray.
+  void selectKernels();
+  Kernels kernels;
+
+  // Print the tree statistics for opt, and for the plain SAH builder to
+  // compare against if opt is something else.
+  void reportAccelerator(const BVHOptions &opt) const;
+  void traceImageWavefront(int w, int h, bool lastPass);
+  // traceImage() with settings.interpolate set: trace the corners of each
+  // blockSize square and fill it in from them where they agree to within
+  // settings.threshold.
+  void traceImageInterpolated(int w, int h, bool lastPass);
+  void interpolateBlock(int i0, int j0, int i1, int j1,
+                        std::vector<glm::dvec3> &colors,
+                        std::vector<char> &traced);
+
+  // aaImage() with settings.aaBudget set: refine whichever cell of the
+  // lattice has the largest estimated error until the budget is spent.
+  // Every ray it traces counts, and it never traces more than the budget.
+  void aaImageBudget();
+  // The colour at lattice point (lx, ly), normalized window coordinates
+  // (x, y): from the first pass or aaLattice if it was traced already.
+  glm::dvec3 aaSample(double x, double y, int lx, int ly);
+  // Trace pixel (i, j) into the first pass and the hit buffer if a preview
+  // only filled it in. Nothing for pixels off the image.
+  void traceFirstPass(int i, int j);
+  // The first pass colour traced at lattice point (lx, ly), or null if
+  // traceImage() traced nothing there.
+  const glm::dvec3 *firstPassAt(int lx, int ly) const {
+    int i = lx / aaScale, j = ly / aaScale;
+    if (!firstPassDone || lx % aaScale || ly % aaScale || i >= buffer_width ||
+        j >= buffer_height)
+      return nullptr;
+    size_t k = (size_t)j * buffer_width + i;
+    if (!firstPassTraced.empty() && !firstPassTraced[k])
+      return nullptr;
+    return &firstPass[k];
+  }
+  // Do the first pass samples around pixel (i, j) disagree enough for it to
+  // need supersampling? geometric is set if the hits themselves differ.
+  bool aaEdge(int i, int j, bool &geometric) const;
+  // Note the colour traced for pixel (i, j), for aaImage() to reuse.
+  void keepFirstPass(int i, int j, const glm::dvec3 &color) {
+    if (!firstPass.empty())
+      firstPass[(size_t)j * buffer_width + i] = color;
+  }
+
+  // Count a ray with depth bounces left as traced, or as cut short.
+  void countRay(int depth, bool cut) {
+    int level = std::max(0, std::min(settings.depth - depth, DEPTH_LEVELS - 1));
+    DepthCounts &c = depthCounts[ray_thread_id];
+    (cut ? c.cut : c.traced)[level]++;
+  }
+  // Is weight too small in every channel to be worth a ray? The same
+  // threshold decides which preview blocks are filled in.
+  bool belowThreshold(const glm::dvec3 &weight) const {
+    return std::max(weight[0], std::max(weight[1], weight[2])) <
+           settings.threshold;
+  }
 
   std::unique_ptr<Scene> scene;
   std::vector<unsigned char> buffer;
-  double thresh;
+  std::function<void(int, int)> rowsDone;
+
+  // When set, camera rays only search the part of the BVH the current
+  // tile's frustum left instead of the whole scene.
+  BVHCut tileCut;
+  const BVHCut *primaryCut = nullptr;
+
+  // Tile-major image used while tracing along a curve (tileMajorW != 0)
+  std::vector<unsigned char> tileBuffer;
+  int tileMajorW = 0, tileMajorH = 0, tilesAcross = 0;
+  unsigned char *pixelAddress(int i, int j);
+  void scatterStrip(int ty);
+  RenderSettings settings;
+  std::unique_ptr<DepthCounts[]> depthCounts; // per ray_thread_id
+
+  // Anti-aliasing samples: the unrounded colour at each pixel's corner from
+  // traceImage() (empty unless an AA pass follows), and the other points of
+  // the subpixel lattice traced so far in the current row of pixels, keyed
+  // by lattice x << 32 | y. aaSamples counts lookups, which is what tracing
+  // every cell's corners afresh would cost; aaTraced the ones that traced.
+  std::vector<glm::dvec3> firstPass;
+  std::vector<char> firstPassTraced; // per pixel; empty when all were traced
+  bool firstPassDone = false;
+  std::unordered_map<uint64_t, glm::dvec3> aaLattice;
+  int aaScale = 1; // lattice steps per pixel
+  size_t aaSamples = 0, aaTraced = 0;
+
+  // With aaEdges set, the first pass's hits too, one per pixel. While
+  // gsample is set, traceRayKernel() fills it in from the next camera ray.
+  std::vector<GSample> gbuffer;
+  GSample *gsample = nullptr;
+  size_t aaPixels = 0; // pixels aaImage() supersampled
+  size_t interpolated = 0; // pixels traceImageInterpolated() did not trace
   int buffer_width, buffer_height;
   bool m_bBufferReady;
 
   int bufferSize;
-  unsigned int threads;
-  int block_size;
-  double aaThresh;
-  int samples;
 
 };
 
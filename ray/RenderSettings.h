@@ -0,0 +1,47 @@
+#ifndef __RENDERSETTINGS_H__
+#define __RENDERSETTINGS_H__
+
+class CubeMap;
+
+// Everything the render path needs to know from the UI. RayTracer copies one
+// of these in traceSetup() and reads only that copy while tracing, so several
+// RayTracers can render with different settings in the same process.
+// TraceUI::renderSettings() fills one in from the current UI state.
+struct RenderSettings {
+  int depth = 0;                    // max depth of recursion
+  int threads = 1;                  // worker threads (wavefront engine)
+  int blockSize = 4;                // block size for interpolation
+  double threshold = 0.0;           // least weight a secondary ray needs, and
+                                    // colour difference worth a ray when
+                                    // interpolating
+  bool interpolate = false;         // trace block corners, fill in the rest?
+  bool antiAlias = false;           // is an AA pass going to follow?
+  int superSamples = 3;             // max AA subdivision depth
+  double aaThreshold = 0.1;         // colour difference that triggers AA
+  bool aaEdges = false;             // AA only where the first pass's hits or
+                                    // colours change
+  int aaBudget = 0;                 // most AA rays to trace, where the error
+                                    // is worst; 0 = refine to aaThreshold
+  const CubeMap *cubeMap = nullptr; // background, or null for black
+  int filterWidth = 1;              // cube map box filter, in texels
+  bool shadows = true;              // cast shadow rays?
+  int packetSize = 1;               // camera rays per packet (1 = off)
+  int tileSize = 16;                // edge of a screen tile, in pixels
+  int pixelOrder = 0;               // PixelOrder of tiles and pixels
+  bool frustumCull = false;         // cull BVH nodes per tile?
+  bool wavefront = false;           // use the WavefrontTracer?
+  bool sortSecondary = false;       // sort wavefront secondary rays?
+  bool accelerate = true;           // trace through a BVH?
+  int bvhBuilder = 0;               // BVHBuilder
+  int treeDepth = 15;               // max BVH depth
+  int leafSize = 10;                // primitives per BVH leaf
+  bool bvhTreelets = false;         // run the treelet pass?
+  double bvhSplitBudget = 0.3;      // SBVH duplicates, per primitive
+  bool bvhStats = false;            // print BVH statistics?
+  bool shadowCache = true;          // cache each light's last occluder?
+  double shadowCutoff = 0.0;        // skip shadow rays for dimmer lights
+  int lightSamples = 0;             // point lights sampled per hit, 0 = all
+  bool debug = false;               // record intersections for the debug view
+};
+
+#endif // __RENDERSETTINGS_H__
@@ -71,6 +71,66 @@ bool Trimesh::intersectLocal(ray &r, isect &i) const {
   return have_one;
 }
 
+// Face-major version of intersectLocal() for a whole packet: each face is
+// tested against all lanes at once with the same arithmetic as
+// TrimeshFace::intersectLocal(), keeping the nearest face per lane. Only the
+// winning face then fills in the intersection record.
+void Trimesh::intersectPacketLocal(const RayPacket &P, isect *i,
+                                   unsigned char *hit) const {
+  const double EPS = 1e-12;
+  const int n = P.size;
+  double bestT[MAX_PACKET];
+  int bestFace[MAX_PACKET];
+  for (int k = 0; k < n; k++) {
+    bestT[k] = 1.0e308;
+    bestFace[k] = -1;
+  }
+
+  for (size_t f = 0; f < faces.size(); f++) {
+    const TrimeshFace *face = faces[f];
+    const glm::dvec3 &A = vertices[(*face)[0]];
+    const glm::dvec3 &B = vertices[(*face)[1]];
+    const glm::dvec3 &C = vertices[(*face)[2]];
+    const glm::dvec3 e1 = B - A;
+    const glm::dvec3 e2 = C - A;
+
+    for (int k = 0; k < n; k++) {
+      // pvec = cross(D, e2)
+      double px = P.dy[k] * e2[2] - e2[1] * P.dz[k];
+      double py = P.dz[k] * e2[0] - e2[2] * P.dx[k];
+      double pz = P.dx[k] * e2[1] - e2[0] * P.dy[k];
+      double det = e1[0] * px + e1[1] * py + e1[2] * pz;
+      double invDet = 1.0 / det;
+      // tvec = O - A, qvec = cross(tvec, e1)
+      double tx = P.ox[k] - A[0];
+      double ty = P.oy[k] - A[1];
+      double tz = P.oz[k] - A[2];
+      double u = (tx * px + ty * py + tz * pz) * invDet;
+      double qx = ty * e1[2] - e1[1] * tz;
+      double qy = tz * e1[0] - e1[2] * tx;
+      double qz = tx * e1[1] - e1[0] * ty;
+      double v = (P.dx[k] * qx + P.dy[k] * qy + P.dz[k] * qz) * invDet;
+      double t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * invDet;
+
+      bool found = P.active[k] & (fabs(det) >= EPS) & (u >= 0.0) &
+                   (u <= 1.0) & (v >= 0.0) & ((u + v) <= 1.0) & (t >= EPS) &
+                   (t < bestT[k]);
+      bestT[k] = found ? t : bestT[k];
+      bestFace[k] = found ? (int)f : bestFace[k];
+    }
+  }
+
+  ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), P.type);
+  for (int k = 0; k < n; k++) {
+    hit[k] = 0;
+    if (bestFace[k] < 0)
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    hit[k] = faces[bestFace[k]]->intersectLocal(r, i[k]);
+  }
+}
+
 bool TrimeshFace::intersect(ray &r, isect &i) const {
   return intersectLocal(r, i);
 }
@@ -203,6 +263,21 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
   return true;
 }
 
+bool Trimesh::bakeTransform() {
+  if (transform.getKind() == MatrixTransform::IDENTITY)
+    return false;
+  for (auto &v : vertices)
+    v = transform.localToGlobalCoords(v);
+  // Normals are left unnormalized, as generateNormals() leaves them, so
+  // interpolating them gives the same direction as before.
+  for (auto &n : normals)
+    n = transform.normalMatrix() * n;
+  for (auto face : faces)
+    face->bake(transform);
+  transform = MatrixTransform();
+  return true;
+}
+
 // Once all the verts and faces are loaded, per vertex normals can be
 // generated by averaging the normals of the neighboring faces.
 void Trimesh::generateNormals() {
@@ -41,6 +41,8 @@ public:
   bool vertNorms;
 
   bool intersectLocal(ray &r, isect &i) const;
+  void intersectPacketLocal(const RayPacket &P, isect *i,
+                            unsigned char *hit) const;
 
   ~Trimesh();
 
@@ -55,6 +57,11 @@ public:
 
   void generateNormals();
 
+  // Move the vertices, normals and face data into world space.
+  bool bakeTransform();
+
+  const std::vector<TrimeshFace *> &getFaces() const { return faces; }
+
   bool hasBoundingBoxCapability() const { return true; }
 
   BoundingBox ComputeLocalBoundingBox() {
@@ -130,6 +137,7 @@ public:
   bool degen;
 
   int operator[](int i) const { return ids[i]; }
+  const glm::dvec3 &vertex(int i) const { return parent->vertices[ids[i]]; }
 
   glm::dvec3 getNormal() const { return normal; }
 
@@ -137,6 +145,16 @@ public:
   bool intersectLocal(ray &r, isect &i) const;
   Trimesh *getParent() const { return parent; }
 
+  // Called by Trimesh::bakeTransform() once the vertices have moved.
+  void bake(const MatrixTransform &xf) {
+    if (!degen) {
+      normal = glm::normalize(xf.normalMatrix() * normal);
+      dist = glm::dot(normal, parent->vertices[ids[0]]);
+    }
+    localbounds = ComputeLocalBoundingBox();
+    bounds = localbounds;
+  }
+
   bool hasBoundingBoxCapability() const { return true; }
 
   BoundingBox ComputeLocalBoundingBox() {
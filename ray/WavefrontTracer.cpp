@@ -0,0 +1,316 @@
+#include "WavefrontTracer.h"
+#include "scene/cubeMap.h"
+#include "scene/light.h"
+#include "scene/lighttree.h"
+#include "scene/morton.h"
+#include "scene/scene.h"
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <thread>
+
+WavefrontTracer::WavefrontTracer(const Scene &scene, int depth,
+                                 const CubeMap *cubemap, int threads,
+                                 bool sortSecondary, double threshold,
+                                 int filterWidth, bool shadows)
+    : scene(scene), maxDepth(depth), cubemap(cubemap),
+      threads(std::max(1, std::min(threads, MAX_THREADS))),
+      sortSecondary(sortSecondary), threshold(threshold),
+      filterWidth(filterWidth), shadows(shadows) {}
+
+void WavefrontTracer::parallelFor(
+    size_t n, const std::function<void(size_t, size_t, size_t)> &fn) {
+  // Not worth starting threads for a handful of rays.
+  size_t nthreads = std::min<size_t>(threads, (n + 63) / 64);
+  if (nthreads <= 1) {
+    fn(0, 0, n);
+    return;
+  }
+  std::vector<std::thread> pool;
+  size_t slice = (n + nthreads - 1) / nthreads;
+  for (size_t t = 0; t < nthreads; t++) {
+    size_t begin = std::min(n, t * slice);
+    size_t end = std::min(n, begin + slice);
+    pool.emplace_back([&fn, begin, end, t] {
+      // Give each worker its own slot in the per-thread ray counters.
+      ray_thread_id = t;
+      fn(t, begin, end);
+    });
+  }
+  for (auto &th : pool)
+    th.join();
+}
+
+void WavefrontTracer::trace(const std::vector<glm::dvec2> &samples,
+                            std::vector<glm::dvec3> &colors,
+                            std::vector<isect> *firstHits) {
+  colors.assign(samples.size(), glm::dvec3(0.0));
+  generate(samples);
+  for (size_t round = 0; !paths.empty(); round++) {
+    if (traced.size() <= round) {
+      traced.push_back(0);
+      cut.push_back(0);
+    }
+    traced[round] += paths.size();
+    closestHit();
+    // The first round is the camera rays, still in sample order
+    if (round == 0 && firstHits)
+      firstHits->assign(hits.begin(), hits.end());
+    shade();
+    shadow();
+    spawn(colors);
+    if (sortSecondary)
+      sortQueue();
+  }
+  for (auto &c : colors)
+    c = glm::clamp(c, 0.0, 1.0);
+}
+
+// Stage 1: one camera ray per sample.
+void WavefrontTracer::generate(const std::vector<glm::dvec2> &samples) {
+  paths.resize(samples.size());
+  spawnOrder.clear();
+  const Camera &camera = scene.getCamera();
+  parallelFor(samples.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
+            ray::VISIBILITY);
+      camera.rayThrough(samples[k].x, samples[k].y, r);
+      PathState &p = paths[k];
+      p.sample = k;
+      p.depth = maxDepth;
+      p.weight = glm::dvec3(1.0);
+      p.position = r.getPosition();
+      p.direction = r.getDirection();
+      p.type = ray::VISIBILITY;
+    }
+  });
+}
+
+// Stage 2: nearest intersection for every queued ray.
+void WavefrontTracer::closestHit() {
+  hits.resize(paths.size());
+  hit.resize(paths.size());
+  parallelFor(paths.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      const PathState &p = paths[k];
+      ray r(p.position, p.direction, glm::dvec3(1.0), p.type);
+      hits[k] = isect();
+      hit[k] = scene.intersect(r, hits[k]);
+    }
+  });
+}
+
+// Stage 3: local shading, minus the shadow tests. Each light that faces the
+// surface gets a query in the shadow queue; misses pick up the background.
+void WavefrontTracer::shade() {
+  local.resize(paths.size());
+  firstQuery.assign(paths.size() + 1, 0);
+
+  // Light terms are gathered per slice, then stitched together in path
+  // order so the query list comes out the same for any thread count.
+  std::vector<std::vector<ShadowQuery>> sliceQueries(threads);
+
+  parallelFor(paths.size(), [&](size_t s, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      const PathState &p = paths[k];
+      if (!hit[k]) {
+        // No intersection: the ray sees the cube map, or black.
+        if (cubemap) {
+          ray r(p.position, p.direction, glm::dvec3(1.0), p.type);
+          local[k] = cubemap->getColor(r, filterWidth);
+        } else {
+          local[k] = glm::dvec3(0.0);
+        }
+        firstQuery[k + 1] = 0;
+        continue;
+      }
+      ray r(p.position, p.direction, glm::dvec3(1.0), p.type);
+      const isect &i = hits[k];
+      const Material &m = i.getMaterial();
+      local[k] = m.shadeBase(&scene, i);
+      int count = 0;
+      auto addQuery = [&](const ShadowQuery &q) {
+        if (q.light.facing) {
+          sliceQueries[s].push_back(q);
+          count++;
+        }
+        if (shadows && !q.light.castShadow)
+          q.light.light->countUncast();
+      };
+      const LightTree *tree = scene.lightTree();
+      for (const auto &pLight : tree ? tree->others() : scene.getAllLights()) {
+        ShadowQuery q;
+        q.hit = k;
+        m.lightTerm(pLight, r, i, q.light);
+        addQuery(q);
+      }
+      if (tree) {
+        LightSample samples[MAX_LIGHT_SAMPLES];
+        int n = m.sampleLights(&scene, r, i, samples);
+        for (int l = 0; l < n; l++) {
+          ShadowQuery q;
+          q.hit = k;
+          q.light = samples[l];
+          addQuery(q);
+        }
+      }
+      firstQuery[k + 1] = count;
+    }
+  });
+
+  for (size_t k = 0; k < paths.size(); k++)
+    firstQuery[k + 1] += firstQuery[k];
+  queries.clear();
+  for (auto &sq : sliceQueries)
+    queries.insert(queries.end(), sq.begin(), sq.end());
+}
+
+// Stage 4: resolve every shadow query, then finish the local shading.
+void WavefrontTracer::shadow() {
+  attenuation.resize(queries.size());
+  parallelFor(queries.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t q = begin; q < end; q++) {
+      const ShadowQuery &sq = queries[q];
+      if (!shadows || !sq.light.castShadow) {
+        attenuation[q] = glm::dvec3(1.0);
+        continue;
+      }
+      const PathState &p = paths[sq.hit];
+      glm::dvec3 surfacePoint = p.position + hits[sq.hit].getT() * p.direction;
+      ray shadowRay(sq.light.origin, sq.light.direction, glm::dvec3(1.0),
+                    ray::SHADOW);
+      attenuation[q] =
+          sq.light.light->shadowAttenuation(shadowRay, surfacePoint);
+    }
+  });
+
+  parallelFor(paths.size(), [&](size_t, size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      if (!hit[k])
+        continue;
+      for (int q = firstQuery[k]; q < firstQuery[k + 1]; q++)
+        local[k] += queries[q].light.contribution * attenuation[q];
+      local[k] = glm::clamp(local[k], glm::dvec3(0.0), glm::dvec3(1.0));
+    }
+  });
+}
+
+// Stage 5: accumulate into the samples and queue reflected and refracted
+// rays for the next round.
+void WavefrontTracer::spawn(std::vector<glm::dvec3> &colors) {
+  std::vector<PathState> next;
+  next.reserve(paths.size());
+
+  // Walk the paths in the order they were spawned, not the order they were
+  // traced in, so colours are summed exactly as traceRay() would.
+  for (size_t n = 0; n < paths.size(); n++) {
+    size_t k = spawnOrder.empty() ? n : spawnOrder[n];
+    const PathState &p = paths[k];
+    colors[p.sample] += p.weight * local[k];
+    if (!hit[k] || p.depth <= 0)
+      continue;
+
+    const isect &i = hits[k];
+    const Material &m = i.getMaterial();
+    glm::dvec3 N = i.getN();
+    glm::dvec3 d = p.direction;
+    glm::dvec3 Q = p.position + i.getT() * d;
+
+    // Rays this one spawns are counted a round further down
+    size_t round = maxDepth - p.depth + 1;
+    auto faint = [&](const glm::dvec3 &weight) {
+      if (std::max(weight[0], std::max(weight[1], weight[2])) >= threshold)
+        return false;
+      if (cut.size() <= round) {
+        traced.resize(round + 1, 0);
+        cut.resize(round + 1, 0);
+      }
+      cut[round]++;
+      return true;
+    };
+
+    // Handle reflection
+    if (m.Refl() && !faint(p.weight * m.kr(i))) {
+      PathState R;
+      R.sample = p.sample;
+      R.depth = p.depth - 1;
+      R.weight = p.weight * m.kr(i);
+      R.position = Q;
+      R.direction = glm::normalize(glm::reflect(d, N));
+      R.type = ray::REFLECTION;
+      next.push_back(R);
+    }
+
+    // Handle refraction
+    if (m.Trans()) {
+      double n_i, n_t;
+      glm::dvec3 Nnew;
+      if (glm::dot(d, N) > 0.0) {
+        // Ray is inside object, going into air
+        n_i = m.index(i);
+        n_t = 1.0;
+        Nnew = -N;
+      } else {
+        // Ray is outside object, going into material
+        n_i = 1.0;
+        n_t = m.index(i);
+        Nnew = N;
+      }
+      glm::dvec3 Td = glm::refract(d, Nnew, n_i / n_t);
+      // Check for total internal reflection
+      if (glm::length(Td) > 0.0 && !faint(p.weight * m.kt(i))) {
+        PathState T;
+        T.sample = p.sample;
+        T.depth = p.depth - 1;
+        T.weight = p.weight * m.kt(i);
+        T.position = Q;
+        T.direction = glm::normalize(Td);
+        T.type = ray::REFRACTION;
+        next.push_back(T);
+      }
+    }
+  }
+
+  paths.swap(next);
+}
+
+// Sort the queue by direction octant, then by the Morton code of the origin
+// on a 1024^3 grid over the scene bounds. Ties keep their spawn order.
+void WavefrontTracer::sortQueue() {
+  size_t n = paths.size();
+  if (n < 2) {
+    spawnOrder.clear();
+    return;
+  }
+
+  glm::dvec3 lo = scene.bounds().getMin();
+  glm::dvec3 extent = scene.bounds().getMax() - lo;
+  glm::dvec3 scale;
+  for (int a = 0; a < 3; a++)
+    scale[a] = extent[a] > 0.0 ? 1023.0 / extent[a] : 0.0;
+
+  std::vector<std::pair<uint64_t, int>> keys(n);
+  for (size_t k = 0; k < n; k++) {
+    const PathState &p = paths[k];
+    uint32_t cell[3];
+    for (int a = 0; a < 3; a++) {
+      double c = (p.position[a] - lo[a]) * scale[a];
+      cell[a] = (uint32_t)std::max(0.0, std::min(1023.0, c));
+    }
+    uint64_t octant = (p.direction[0] < 0.0 ? 1 : 0) |
+                      (p.direction[1] < 0.0 ? 2 : 0) |
+                      (p.direction[2] < 0.0 ? 4 : 0);
+    keys[k].first = (octant << 30) | morton3D(cell[0], cell[1], cell[2]);
+    keys[k].second = (int)k;
+  }
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<PathState> sorted(n);
+  spawnOrder.resize(n);
+  for (size_t pos = 0; pos < n; pos++) {
+    sorted[pos] = paths[keys[pos].second];
+    spawnOrder[keys[pos].second] = (int)pos;
+  }
+  paths.swap(sorted);
+}
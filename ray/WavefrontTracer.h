@@ -0,0 +1,103 @@
+#ifndef __WAVEFRONTTRACER_H__
+#define __WAVEFRONTTRACER_H__
+
+// A breadth-first alternative to RayTracer::traceRay.
+//
+// Instead of following one ray all the way down its reflection/refraction
+// tree before starting the next, the wavefront engine keeps queues of rays
+// grouped by what needs to happen to them next, and runs each stage over the
+// whole queue at once, split across threads:
+//
+//   camera generation -> closest hit -> shading -> shadow rays -> spawn
+//
+// The spawn stage refills the closest-hit queue with reflected and refracted
+// rays until the depth limit is reached. The result matches traceRay().
+//
+// Optionally the refilled queue is sorted by direction octant and a Morton
+// code of the ray origin before it is traced, so rays that will touch the
+// same parts of the scene run back to back.
+
+#include "scene/material.h"
+#include "scene/ray.h"
+#include <functional>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <vector>
+
+class Scene;
+class CubeMap;
+
+class WavefrontTracer {
+public:
+  // Reflected and refracted rays whose weight would fall below threshold in
+  // every channel are dropped, as in RayTracer::traceRay(). With shadows
+  // off, every light reaches every surface facing it.
+  WavefrontTracer(const Scene &scene, int depth, const CubeMap *cubemap,
+                  int threads, bool sortSecondary = false,
+                  double threshold = 0.0, int filterWidth = 1,
+                  bool shadows = true);
+
+  // Trace one camera ray per entry of samples (normalized window
+  // coordinates, as for Camera::rayThrough) and return the clamped colours.
+  // If firstHits is given, it gets each camera ray's hit too (a default
+  // isect, with no object, for a miss).
+  void trace(const std::vector<glm::dvec2> &samples,
+             std::vector<glm::dvec3> &colors,
+             std::vector<isect> *firstHits = nullptr);
+
+  // Rays traced in each round so far, over every call to trace(), and the
+  // rays each round would have had but for the threshold. Round 0 is the
+  // camera rays.
+  const std::vector<size_t> &tracedPerRound() const { return traced; }
+  const std::vector<size_t> &cutPerRound() const { return cut; }
+
+private:
+  // A ray waiting in the closest-hit queue.
+  struct PathState {
+    int sample;        // which entry of colors this ray contributes to
+    int depth;         // remaining bounces
+    glm::dvec3 weight; // product of kr/kt along the path so far
+    glm::dvec3 position;
+    glm::dvec3 direction;
+    ray::RayType type;
+  };
+
+  // A shadow ray waiting in the any-hit queue.
+  struct ShadowQuery {
+    int hit; // index into the hit queue
+    LightSample light;
+  };
+
+  void generate(const std::vector<glm::dvec2> &samples);
+  void closestHit();
+  void shade();
+  void shadow();
+  void spawn(std::vector<glm::dvec3> &colors);
+  void sortQueue();
+
+  // Split [0, n) into contiguous slices, at most one per thread, and run
+  // fn(slice, begin, end) on each.
+  void parallelFor(size_t n,
+                   const std::function<void(size_t, size_t, size_t)> &fn);
+
+  const Scene &scene;
+  int maxDepth;
+  const CubeMap *cubemap;
+  int threads;
+  bool sortSecondary;
+  double threshold;
+  int filterWidth; // of the cube map's box filter
+  bool shadows;    // cast shadow rays?
+  std::vector<size_t> traced, cut;
+
+  std::vector<PathState> paths;  // closest-hit queue
+  std::vector<isect> hits;       // one per path
+  std::vector<char> hit;         // did paths[k] hit anything?
+  std::vector<glm::dvec3> local; // shading result per path
+  std::vector<int> firstQuery;   // shadow queries of path k start here
+  std::vector<ShadowQuery> queries;
+  std::vector<glm::dvec3> attenuation; // one per shadow query
+  std::vector<int> spawnOrder; // where the n-th spawned path was sorted to
+};
+
+#endif // __WAVEFRONTTRACER_H__
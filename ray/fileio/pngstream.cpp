@@ -0,0 +1,314 @@
+#include "pngstream.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <zlib.h>
+
+using std::string;
+
+namespace {
+
+// Aim for roughly this much raw image data per independently compressed
+// chunk. Smaller chunks parallelize better, larger ones compress better.
+constexpr int CHUNK_BYTES = 1 << 17;
+
+void putU32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return (uint8_t)a;
+  return (uint8_t)(pb <= pc ? b : c);
+}
+
+// Apply PNG filter type `type` to one row. prev may be NULL (no row above).
+void filterRow(int type, const uint8_t *row, const uint8_t *prev, int n,
+               uint8_t *out) {
+  for (int x = 0; x < n; x++) {
+    int a = x >= 3 ? row[x - 3] : 0;
+    int b = prev ? prev[x] : 0;
+    int c = (prev && x >= 3) ? prev[x - 3] : 0;
+    switch (type) {
+    case 0:
+      out[x] = row[x];
+      break;
+    case 1:
+      out[x] = (uint8_t)(row[x] - a);
+      break;
+    case 2:
+      out[x] = (uint8_t)(row[x] - b);
+      break;
+    case 3:
+      out[x] = (uint8_t)(row[x] - ((a + b) >> 1));
+      break;
+    default:
+      out[x] = (uint8_t)(row[x] - paeth(a, b, c));
+      break;
+    }
+  }
+}
+
+// The usual "minimum sum of absolute differences" heuristic from the PNG
+// spec: try every filter and keep the one with the smallest signed sum.
+void filterBest(const uint8_t *row, const uint8_t *prev, int n, uint8_t *out,
+                std::vector<uint8_t> &scratch) {
+  scratch.resize(n);
+  long best = -1;
+  int ntypes = prev ? 5 : 2;
+  for (int type = 0; type < ntypes; type++) {
+    filterRow(type, row, prev, n, scratch.data());
+    long sum = 0;
+    for (int x = 0; x < n; x++)
+      sum += abs((int)(int8_t)scratch[x]);
+    if (best < 0 || sum < best) {
+      best = sum;
+      out[0] = (uint8_t)type;
+      memcpy(out + 1, scratch.data(), n);
+    }
+  }
+}
+
+} // anonymous namespace
+
+PNGStreamWriter::PNGStreamWriter(const char *fname, int width, int height,
+                                 int level, int threads)
+    : fp(NULL), width(width), height(height), level(level), src(NULL),
+      nextToWrite(0), adler(adler32(0L, Z_NULL, 0)), finished(false),
+      failed(false), stopping(false) {
+  fp = fopen(fname, "wb");
+  if (!fp)
+    throw string("[PNGStreamWriter] File could not be opened for "
+                 "writing: ") +
+        fname;
+
+  if (this->level < Z_DEFAULT_COMPRESSION || this->level > 9)
+    this->level = Z_DEFAULT_COMPRESSION;
+
+  static const uint8_t signature[8] = {0x89, 'P',  'N',  'G',
+                                       '\r', '\n', 0x1a, '\n'};
+  fwrite(signature, 1, 8, fp);
+
+  uint8_t ihdr[13];
+  putU32(ihdr, width);
+  putU32(ihdr + 4, height);
+  ihdr[8] = 8;  // bit depth
+  ihdr[9] = 2;  // colour type: RGB
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+  writeChunk("IHDR", ihdr, sizeof(ihdr));
+
+  rowsPerChunk = std::max(1, CHUNK_BYTES / (3 * width + 1));
+  int nchunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+  chunks.resize(nchunks);
+  for (int k = 0; k < nchunks; k++) {
+    Chunk &c = chunks[k];
+    c.first = k * rowsPerChunk;
+    c.count = std::min(rowsPerChunk, height - c.first);
+    c.arrived = 0;
+    c.queued = false;
+    c.done = false;
+    c.adler = 0;
+  }
+
+  int nthreads = std::max(1, std::min(threads, nchunks));
+  for (int t = 0; t < nthreads; t++)
+    workers.emplace_back(&PNGStreamWriter::worker, this);
+}
+
+PNGStreamWriter::~PNGStreamWriter() {
+  if (!finished) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+      jobs.clear();
+    }
+    cv.notify_all();
+    for (auto &w : workers)
+      w.join();
+    if (fp)
+      fclose(fp);
+  }
+}
+
+void PNGStreamWriter::addRows(int y0, int y1, const void *data) {
+  std::unique_lock<std::mutex> guard(lock);
+  src = (const uint8_t *)data;
+  bool queued = false;
+  for (int y = std::max(y0, 0); y < std::min(y1, height); y++) {
+    // The buffer is bottom-up; PNG rows are top-down.
+    Chunk &c = chunks[(height - 1 - y) / rowsPerChunk];
+    if (++c.arrived == c.count && !c.queued) {
+      c.queued = true;
+      jobs.push_back(&c - chunks.data());
+      queued = true;
+    }
+  }
+  guard.unlock();
+  if (queued)
+    cv.notify_all();
+}
+
+void PNGStreamWriter::finish() {
+  if (finished)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!src)
+      throw string("[PNGStreamWriter] finish() called before any rows");
+    for (size_t k = 0; k < chunks.size(); k++) {
+      if (!chunks[k].queued) {
+        chunks[k].queued = true;
+        jobs.push_back(k);
+      }
+    }
+    stopping = true;
+  }
+  cv.notify_all();
+  for (auto &w : workers)
+    w.join();
+  workers.clear();
+  flushReady();
+
+  finished = true;
+  writeChunk("IEND", NULL, 0);
+  fclose(fp);
+  fp = NULL;
+
+  if (failed || nextToWrite != chunks.size())
+    throw string("[PNGStreamWriter] Error during compression");
+}
+
+void PNGStreamWriter::worker() {
+  for (;;) {
+    int k;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      cv.wait(guard, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        return;
+      k = jobs.front();
+      jobs.pop_front();
+    }
+    compress(chunks[k]);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      chunks[k].done = true;
+    }
+    flushReady();
+  }
+}
+
+void PNGStreamWriter::compress(Chunk &c) {
+  const int rowBytes = 3 * width;
+  const size_t rawSize = (size_t)c.count * (rowBytes + 1);
+  std::vector<uint8_t> raw(rawSize);
+  std::vector<uint8_t> scratch;
+
+  for (int r = 0; r < c.count; r++) {
+    int y = c.first + r;
+    const uint8_t *row = src + (size_t)(height - 1 - y) * rowBytes;
+    // Only look at the row above when it lives in this chunk: the output
+    // then does not depend on the order in which rows were handed over.
+    const uint8_t *prev = r > 0 ? row + rowBytes : NULL;
+    filterBest(row, prev, rowBytes, raw.data() + r * (rowBytes + 1), scratch);
+  }
+  c.adler = adler32(adler32(0L, Z_NULL, 0), raw.data(), rawSize);
+
+  bool last = (&c == &chunks.back());
+  bool first = (&c == &chunks.front());
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    failed = true;
+    return;
+  }
+
+  // zlib header: deflate, 32K window, FLEVEL from the compression level.
+  size_t head = 0;
+  c.out.resize(deflateBound(&zs, rawSize) + 16);
+  if (first) {
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2
+                 : level < 2                    ? 0
+                 : level < 6                    ? 1
+                 : level == 6                   ? 2
+                                                : 3;
+    uint8_t cmf = 0x78;
+    uint8_t flg = (uint8_t)(flevel << 6);
+    flg += 31 - (cmf * 256 + flg) % 31;
+    c.out[0] = cmf;
+    c.out[1] = flg;
+    head = 2;
+  }
+
+  zs.next_in = raw.data();
+  zs.avail_in = (uInt)rawSize;
+  int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  int ret;
+  do {
+    if (zs.total_out + head + 64 > c.out.size())
+      c.out.resize(c.out.size() * 2);
+    zs.next_out = c.out.data() + head + zs.total_out;
+    zs.avail_out = (uInt)(c.out.size() - head - zs.total_out);
+    ret = deflate(&zs, flush);
+  } while (ret == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0 || last));
+
+  if ((last && ret != Z_STREAM_END) || (!last && ret != Z_OK &&
+                                        ret != Z_BUF_ERROR))
+    failed = true;
+  c.out.resize(head + zs.total_out);
+  deflateEnd(&zs);
+}
+
+// Write every compressed chunk whose predecessors are already on disk.
+void PNGStreamWriter::flushReady() {
+  std::lock_guard<std::mutex> fguard(fileLock);
+  for (;;) {
+    Chunk *c;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (nextToWrite >= chunks.size() || !chunks[nextToWrite].done)
+        return;
+      c = &chunks[nextToWrite];
+    }
+    size_t rawSize = (size_t)c->count * (3 * width + 1);
+    adler = adler32_combine(adler, c->adler, rawSize);
+    if (c == &chunks.back()) {
+      uint8_t trailer[4];
+      putU32(trailer, adler);
+      c->out.insert(c->out.end(), trailer, trailer + 4);
+    }
+    writeChunk("IDAT", c->out.data(), c->out.size());
+    std::vector<uint8_t>().swap(c->out);
+    nextToWrite++;
+  }
+}
+
+void PNGStreamWriter::writeChunk(const char *type, const uint8_t *body,
+                                 size_t len) {
+  uint8_t head[8];
+  putU32(head, (uint32_t)len);
+  memcpy(head + 4, type, 4);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, head + 4, 4);
+  if (len)
+    crc = crc32(crc, body, (uInt)len);
+  uint8_t tail[4];
+  putU32(tail, (uint32_t)crc);
+
+  fwrite(head, 1, 8, fp);
+  if (len)
+    fwrite(body, 1, len, fp);
+  fwrite(tail, 1, 4, fp);
+}
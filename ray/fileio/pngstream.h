@@ -0,0 +1,76 @@
+#ifndef FILEIO_PNGSTREAM_H
+#define FILEIO_PNGSTREAM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+/*
+ * PNGStreamWriter
+ *
+ * Writes an 8-bit RGB PNG while the image is still being rendered. The
+ * renderer hands over bands of finished rows with addRows(); as soon as every
+ * row of a chunk has arrived, a worker thread filters and deflates that chunk
+ * on its own. Chunks are raw deflate streams ended with a sync flush, so they
+ * can be compressed in any order and still be concatenated, in image order,
+ * into the single zlib stream carried by the IDAT chunks. The Adler-32 of
+ * the whole stream is stitched together from the per-chunk checksums.
+ *
+ * Like writePNG(), the input buffer is bottom-up (row 0 is the bottom of the
+ * image) with 3 bytes per pixel and no row padding.
+ */
+class PNGStreamWriter {
+public:
+  PNGStreamWriter(const char *fname, int width, int height, int level = 6,
+                  int threads = 1);
+  ~PNGStreamWriter();
+
+  // Rows [y0, y1) of data are final. data must stay valid until finish().
+  void addRows(int y0, int y1, const void *data);
+
+  // Wait for the outstanding chunks, then write the trailer and close the
+  // file. Rows that were never added are taken from the last data pointer.
+  void finish();
+
+private:
+  struct Chunk {
+    int first;   // first PNG row (top-down) in this chunk
+    int count;   // number of rows
+    int arrived; // rows handed over so far
+    bool queued;
+    bool done;
+    uint32_t adler;
+    std::vector<uint8_t> out; // compressed bytes
+  };
+
+  void worker();
+  void compress(Chunk &c);
+  void flushReady();
+  void writeChunk(const char *type, const uint8_t *body, size_t len);
+
+  FILE *fp;
+  int width, height;
+  int level;
+  int rowsPerChunk;
+  const uint8_t *src;
+
+  std::vector<Chunk> chunks;
+  size_t nextToWrite;
+  uint32_t adler;
+  bool finished;
+  std::atomic<bool> failed;
+
+  std::mutex lock;
+  std::mutex fileLock;
+  std::condition_variable cv;
+  std::deque<int> jobs;
+  bool stopping;
+  std::vector<std::thread> workers;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "bbox.h"
 #include "ray.h"
+#include "raypacket.h"
 
 BoundingBox::BoundingBox() : bEmpty(true) {}
 
@@ -62,6 +63,45 @@ bool BoundingBox::intersect(const ray &r, double &tMin, double &tMax) const {
   return true; // it made it past all 3 axes.
 }
 
+int BoundingBox::intersect(const RayPacket &P, unsigned char *hit) const {
+  // The loop above, written without early exits so it runs over all lanes
+  // at once. An axis the ray is parallel to adds no constraint.
+  const double *R0[3] = {P.ox, P.oy, P.oz};
+  const double *Rd[3] = {P.dx, P.dy, P.dz};
+  double tMin[MAX_PACKET], tMax[MAX_PACKET];
+  for (int k = 0; k < P.size; k++) {
+    tMin[k] = -1.0e308;
+    tMax[k] = 1.0e308;
+    hit[k] = P.active[k];
+  }
+
+  for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
+    const double *o = R0[currentaxis];
+    const double *d = Rd[currentaxis];
+    double lo = bmin[currentaxis];
+    double hi = bmax[currentaxis];
+    for (int k = 0; k < P.size; k++) {
+      double vd = d[k];
+      double t1 = (lo - o[k]) / vd;
+      double t2 = (hi - o[k]) / vd;
+      double tnear = t1 > t2 ? t2 : t1;
+      double tfar = t1 > t2 ? t1 : t2;
+      if (vd == 0.0) {
+        tnear = -1.0e308;
+        tfar = 1.0e308;
+      }
+      tMin[k] = tnear > tMin[k] ? tnear : tMin[k];
+      tMax[k] = tfar < tMax[k] ? tfar : tMax[k];
+      hit[k] &= (tMin[k] <= tMax[k]) & (tMax[k] >= RAY_EPSILON);
+    }
+  }
+
+  int count = 0;
+  for (int k = 0; k < P.size; k++)
+    count += hit[k];
+  return count;
+}
+
 double BoundingBox::area() {
   if (bEmpty)
     return 0.0;
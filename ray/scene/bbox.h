@@ -2,6 +2,7 @@
 
 #include <glm/vec3.hpp>
 class ray;
+class RayPacket;
 
 class BoundingBox {
   bool bEmpty;
@@ -56,6 +57,10 @@ public:
   // return true, else return false.
   bool intersect(const ray &r, double &tMin, double &tMax) const;
 
+  // Same test for every active lane of a packet: hit[k] is set when lane k
+  // hits the box. Returns the number of lanes that hit.
+  int intersect(const RayPacket &P, unsigned char *hit) const;
+
   double area();
   double volume();
   void merge(const BoundingBox &bBox);
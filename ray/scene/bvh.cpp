@@ -0,0 +1,1057 @@
+#include "bvh.h"
+#include "frustum.h"
+#include "morton.h"
+
+#include "../SceneObjects/trimesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <glm/glm.hpp>
+#include <thread>
+
+namespace {
+
+const int SAH_BINS = 16;
+const int TREELET_LEAVES = 5;
+// Entries in a traversal stack. Searching under a node at depth d needs
+// d + 2, so no interior node is kept deeper than STACK_SIZE - 2.
+const int STACK_SIZE = 64;
+// How far down cull() tests nodes, so a tile has at most 2^CULL_LEVELS roots
+const int CULL_LEVELS = 6;
+// Spatial splits are only tried where the object split's halves overlap by
+// more than this fraction of the root's surface area.
+const double SBVH_OVERLAP = 1.0e-5;
+
+struct BuildRef {
+  glm::dvec3 lo, hi, c; // bounds and centroid
+  PrimRef ref;
+  const TrimeshFace *face; // PRIM_TRIANGLE only, for clipping
+};
+
+struct BuildNode {
+  glm::dvec3 lo, hi;
+  int left = -1, right = -1; // children, or -1 for a leaf
+  int first = 0, count = 0;  // a leaf's refs
+  double cost = 0.0;         // SAH cost of the subtree
+};
+
+double area(const glm::dvec3 &lo, const glm::dvec3 &hi) {
+  glm::dvec3 e = glm::max(hi - lo, glm::dvec3(0.0));
+  return 2.0 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+}
+
+// Sort keys by value, a byte at a time, keeping equal keys in their input
+// order. Each pass counts and scatters in slices, one per thread.
+void radixSort(std::vector<std::pair<uint64_t, int>> &keys, int threads) {
+  size_t n = keys.size();
+  size_t nthreads = std::max<size_t>(1, std::min<size_t>(threads, n / 4096));
+  size_t slice = (n + nthreads - 1) / nthreads;
+  std::vector<std::pair<uint64_t, int>> tmp(n);
+  std::vector<size_t> count(nthreads * 256);
+
+  auto run = [&](const std::function<void(size_t)> &fn) {
+    if (nthreads == 1) {
+      fn(0);
+      return;
+    }
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < nthreads; t++)
+      pool.emplace_back(fn, t);
+    for (auto &th : pool)
+      th.join();
+  };
+
+  for (int shift = 0; shift < 64; shift += 8) {
+    std::fill(count.begin(), count.end(), 0);
+    run([&](size_t t) {
+      size_t *c = &count[t * 256];
+      for (size_t k = t * slice; k < std::min(n, (t + 1) * slice); k++)
+        c[(keys[k].first >> shift) & 0xff]++;
+    });
+
+    // A pass where every key has the same digit changes nothing.
+    bool trivial = false;
+    for (int d = 0; d < 256 && !trivial; d++) {
+      size_t total = 0;
+      for (size_t t = 0; t < nthreads; t++)
+        total += count[t * 256 + d];
+      trivial = total == n;
+    }
+    if (trivial)
+      continue;
+
+    // Turn the counts into each slice's first slot for each digit.
+    size_t sum = 0;
+    for (int d = 0; d < 256; d++)
+      for (size_t t = 0; t < nthreads; t++) {
+        size_t c = count[t * 256 + d];
+        count[t * 256 + d] = sum;
+        sum += c;
+      }
+
+    run([&](size_t t) {
+      size_t *c = &count[t * 256];
+      for (size_t k = t * slice; k < std::min(n, (t + 1) * slice); k++)
+        tmp[c[(keys[k].first >> shift) & 0xff]++] = keys[k];
+    });
+    keys.swap(tmp);
+  }
+}
+
+// The best binned object split of a set of refs: refs whose centroid falls
+// in a bin below bin go left.
+struct ObjectSplit {
+  int axis = -1; // -1: the centroids all coincide
+  int bin = 0;
+  double cmin = 0.0, scale = 0.0;
+  double cost = 1.0e308;
+  glm::dvec3 lo[2], hi[2]; // bounds of the two sides
+
+  int binOf(const BuildRef &r) const {
+    return std::min(SAH_BINS - 1, (int)((r.c[axis] - cmin) * scale));
+  }
+};
+
+// The best of the planes between SAH_BINS equal slabs of a node's box. Refs
+// crossing the plane go to both sides, clipped.
+struct SpatialSplit {
+  int axis = -1; // -1: none found
+  int bin = 0;
+  double lo = 0.0, width = 0.0;
+  double cost = 1.0e308;
+
+  int binOf(double x) const {
+    return std::max(0, std::min(SAH_BINS - 1, (int)((x - lo) / width)));
+  }
+  // The plane below bin b; the outer planes are open.
+  double plane(int b) const {
+    if (b <= 0)
+      return -1.0e308;
+    if (b >= SAH_BINS)
+      return 1.0e308;
+    return lo + b * width;
+  }
+};
+
+class Builder {
+public:
+  Builder(std::vector<BuildRef> &refs, const BVHOptions &opt)
+      : refs(refs), opt(opt) {}
+
+  std::vector<BuildNode> nodes;
+
+  int sah(int begin, int end, int depth);
+  int lbvh(const BoundingBox &sceneBounds);
+  int sbvh();
+  void treelets(int root);
+
+private:
+  std::vector<BuildRef> &refs;
+  const BVHOptions &opt;
+  std::vector<uint64_t> codes;
+
+  // SBVH state: refs move into out as leaves are made
+  std::vector<BuildRef> out;
+  long spare = 0;         // duplicates the budget still allows
+  double rootArea = 0.0;  // spatial splits are tried where halves overlap
+  double pad = 0.0;       // added around clipped bounds
+
+  int leaf(int begin, int end) {
+    return leaf(refs.data() + begin, end - begin, begin);
+  }
+  int leaf(const BuildRef *r, int count, int first);
+  int interior(int left, int right);
+  int emit(int begin, int end, int bit, int depth);
+  void optimizeTreelet(int root);
+
+  ObjectSplit findObjectSplit(const BuildRef *r, int count) const;
+  int partition(BuildRef *r, int count, const ObjectSplit &split) const;
+  int spatial(std::vector<BuildRef> &set, int depth);
+  SpatialSplit findSpatialSplit(const std::vector<BuildRef> &set,
+                                const glm::dvec3 &lo,
+                                const glm::dvec3 &hi) const;
+  bool clip(const BuildRef &r, int axis, double a, double b,
+            BuildRef &piece) const;
+};
+
+int Builder::leaf(const BuildRef *r, int count, int first) {
+  BuildNode n;
+  n.lo = glm::dvec3(1.0e308);
+  n.hi = glm::dvec3(-1.0e308);
+  for (int k = 0; k < count; k++) {
+    n.lo = glm::min(n.lo, r[k].lo);
+    n.hi = glm::max(n.hi, r[k].hi);
+  }
+  n.first = first;
+  n.count = count;
+  n.cost = area(n.lo, n.hi) * n.count;
+  nodes.push_back(n);
+  return (int)nodes.size() - 1;
+}
+
+int Builder::interior(int left, int right) {
+  BuildNode n;
+  n.left = left;
+  n.right = right;
+  n.lo = glm::min(nodes[left].lo, nodes[right].lo);
+  n.hi = glm::max(nodes[left].hi, nodes[right].hi);
+  n.cost = area(n.lo, n.hi) + nodes[left].cost + nodes[right].cost;
+  nodes.push_back(n);
+  return (int)nodes.size() - 1;
+}
+
+ObjectSplit Builder::findObjectSplit(const BuildRef *r, int count) const {
+  ObjectSplit split;
+  glm::dvec3 cmin(1.0e308), cmax(-1.0e308);
+  for (int k = 0; k < count; k++) {
+    cmin = glm::min(cmin, r[k].c);
+    cmax = glm::max(cmax, r[k].c);
+  }
+  int axis = 0;
+  glm::dvec3 extent = cmax - cmin;
+  if (extent[1] > extent[axis])
+    axis = 1;
+  if (extent[2] > extent[axis])
+    axis = 2;
+  if (extent[axis] <= 0.0)
+    return split;
+  split.axis = axis;
+  split.cmin = cmin[axis];
+  split.scale = SAH_BINS / extent[axis];
+
+  // Drop the centroids into bins and sweep the bin boundaries
+  struct Bin {
+    glm::dvec3 lo = glm::dvec3(1.0e308), hi = glm::dvec3(-1.0e308);
+    int count = 0;
+  } bins[SAH_BINS];
+  for (int k = 0; k < count; k++) {
+    Bin &b = bins[split.binOf(r[k])];
+    b.lo = glm::min(b.lo, r[k].lo);
+    b.hi = glm::max(b.hi, r[k].hi);
+    b.count++;
+  }
+
+  double rightCost[SAH_BINS];
+  glm::dvec3 rightLo[SAH_BINS], rightHi[SAH_BINS];
+  glm::dvec3 lo(1.0e308), hi(-1.0e308);
+  int n = 0;
+  for (int b = SAH_BINS - 1; b > 0; b--) {
+    lo = glm::min(lo, bins[b].lo);
+    hi = glm::max(hi, bins[b].hi);
+    n += bins[b].count;
+    rightCost[b] = n ? area(lo, hi) * n : 0.0;
+    rightLo[b] = lo;
+    rightHi[b] = hi;
+  }
+  lo = glm::dvec3(1.0e308);
+  hi = glm::dvec3(-1.0e308);
+  n = 0;
+  for (int b = 1; b < SAH_BINS; b++) {
+    lo = glm::min(lo, bins[b - 1].lo);
+    hi = glm::max(hi, bins[b - 1].hi);
+    n += bins[b - 1].count;
+    double cost = (n ? area(lo, hi) * n : 0.0) + rightCost[b];
+    if (cost < split.cost) {
+      split.cost = cost;
+      split.bin = b;
+      split.lo[0] = lo;
+      split.hi[0] = hi;
+      split.lo[1] = rightLo[b];
+      split.hi[1] = rightHi[b];
+    }
+  }
+  return split;
+}
+
+// Put the refs going left first and return how many there are. If the bins
+// put everything on one side, split at the median centroid instead.
+int Builder::partition(BuildRef *r, int count,
+                       const ObjectSplit &split) const {
+  int mid = (int)(std::partition(r, r + count,
+                                 [&](const BuildRef &b) {
+                                   return split.binOf(b) < split.bin;
+                                 }) -
+                  r);
+  if (mid == 0 || mid == count) {
+    mid = count / 2;
+    std::nth_element(r, r + mid, r + count,
+                     [&](const BuildRef &a, const BuildRef &b) {
+                       return a.c[split.axis] < b.c[split.axis];
+                     });
+  }
+  return mid;
+}
+
+int Builder::sah(int begin, int end, int depth) {
+  int count = end - begin;
+  if (count <= opt.leafSize || depth >= opt.maxDepth)
+    return leaf(begin, end);
+
+  ObjectSplit split = findObjectSplit(refs.data() + begin, count);
+  if (split.axis < 0)
+    return leaf(begin, end); // all centroids coincide
+  int mid = begin + partition(refs.data() + begin, count, split);
+
+  int left = sah(begin, mid, depth + 1);
+  int right = sah(mid, end, depth + 1);
+  return interior(left, right);
+}
+
+int Builder::sbvh() {
+  glm::dvec3 lo(1.0e308), hi(-1.0e308);
+  for (const BuildRef &r : refs) {
+    lo = glm::min(lo, r.lo);
+    hi = glm::max(hi, r.hi);
+  }
+  glm::dvec3 extent = hi - lo;
+  rootArea = area(lo, hi);
+  pad = 1.0e-9 * std::max(extent[0], std::max(extent[1], extent[2]));
+  spare = (long)(refs.size() * std::max(0.0, opt.splitBudget));
+
+  std::vector<BuildRef> all;
+  all.swap(refs);
+  out.reserve(all.size() + spare);
+  int root = spatial(all, 0);
+  refs.swap(out);
+  return root;
+}
+
+// Like sah(), but a split may also cut the node's box with a plane and send
+// refs that cross it to both sides, while the budget lasts. That is only
+// worth looking for where the halves of the object split overlap.
+int Builder::spatial(std::vector<BuildRef> &set, int depth) {
+  int count = (int)set.size();
+  if (count <= opt.leafSize || depth >= opt.maxDepth) {
+    int first = (int)out.size();
+    out.insert(out.end(), set.begin(), set.end());
+    return leaf(out.data() + first, count, first);
+  }
+
+  ObjectSplit object = findObjectSplit(set.data(), count);
+  SpatialSplit cut;
+  if (spare > 0) {
+    double overlap = rootArea;
+    if (object.axis >= 0) {
+      glm::dvec3 lo = glm::max(object.lo[0], object.lo[1]);
+      glm::dvec3 hi = glm::min(object.hi[0], object.hi[1]);
+      overlap = lo[0] < hi[0] && lo[1] < hi[1] && lo[2] < hi[2] ? area(lo, hi)
+                                                               : 0.0;
+    }
+    if (overlap > SBVH_OVERLAP * rootArea) {
+      glm::dvec3 lo(1.0e308), hi(-1.0e308);
+      for (const BuildRef &r : set) {
+        lo = glm::min(lo, r.lo);
+        hi = glm::max(hi, r.hi);
+      }
+      cut = findSpatialSplit(set, lo, hi);
+    }
+  }
+
+  std::vector<BuildRef> left, right;
+  if (cut.axis >= 0 && cut.cost < object.cost) {
+    double at = cut.plane(cut.bin);
+    for (const BuildRef &r : set) {
+      BuildRef piece;
+      if (r.hi[cut.axis] <= at) {
+        left.push_back(r);
+      } else if (r.lo[cut.axis] >= at) {
+        right.push_back(r);
+      } else {
+        bool l = clip(r, cut.axis, -1.0e308, at, piece);
+        if (l)
+          left.push_back(piece);
+        if (clip(r, cut.axis, at, 1.0e308, piece)) {
+          right.push_back(piece);
+          spare -= l;
+        } else if (!l) {
+          left.push_back(r); // lost to rounding: keep it whole
+        }
+      }
+    }
+  }
+  if (left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+    if (object.axis < 0) {
+      int first = (int)out.size();
+      out.insert(out.end(), set.begin(), set.end());
+      return leaf(out.data() + first, count, first);
+    }
+    int mid = partition(set.data(), count, object);
+    left.assign(set.begin(), set.begin() + mid);
+    right.assign(set.begin() + mid, set.end());
+  }
+  std::vector<BuildRef>().swap(set);
+
+  int l = spatial(left, depth + 1);
+  int r = spatial(right, depth + 1);
+  return interior(l, r);
+}
+
+SpatialSplit Builder::findSpatialSplit(const std::vector<BuildRef> &set,
+                                       const glm::dvec3 &lo,
+                                       const glm::dvec3 &hi) const {
+  SpatialSplit best;
+  for (int axis = 0; axis < 3; axis++) {
+    SpatialSplit s;
+    s.axis = axis;
+    s.lo = lo[axis];
+    s.width = (hi[axis] - lo[axis]) / SAH_BINS;
+    if (s.width <= 0.0)
+      continue;
+
+    // Each bin gets the bounds of the pieces of the refs inside it, and
+    // counts the refs that start and end in it.
+    glm::dvec3 binLo[SAH_BINS], binHi[SAH_BINS];
+    int enter[SAH_BINS] = {0}, leave[SAH_BINS] = {0};
+    for (int b = 0; b < SAH_BINS; b++) {
+      binLo[b] = glm::dvec3(1.0e308);
+      binHi[b] = glm::dvec3(-1.0e308);
+    }
+    for (const BuildRef &r : set) {
+      int b0 = s.binOf(r.lo[axis]), b1 = s.binOf(r.hi[axis]);
+      enter[b0]++;
+      leave[b1]++;
+      for (int b = b0; b <= b1; b++) {
+        BuildRef piece = r;
+        if (b0 != b1 && !clip(r, axis, s.plane(b), s.plane(b + 1), piece))
+          continue;
+        binLo[b] = glm::min(binLo[b], piece.lo);
+        binHi[b] = glm::max(binHi[b], piece.hi);
+      }
+    }
+
+    double rightCost[SAH_BINS];
+    int rightCount[SAH_BINS];
+    glm::dvec3 l(1.0e308), h(-1.0e308);
+    int n = 0;
+    for (int b = SAH_BINS - 1; b > 0; b--) {
+      l = glm::min(l, binLo[b]);
+      h = glm::max(h, binHi[b]);
+      n += leave[b];
+      rightCost[b] = n ? area(l, h) * n : 0.0;
+      rightCount[b] = n;
+    }
+    l = glm::dvec3(1.0e308);
+    h = glm::dvec3(-1.0e308);
+    n = 0;
+    for (int b = 1; b < SAH_BINS; b++) {
+      l = glm::min(l, binLo[b - 1]);
+      h = glm::max(h, binHi[b - 1]);
+      n += enter[b - 1];
+      if (!n || !rightCount[b])
+        continue;
+      double cost = area(l, h) * n + rightCost[b];
+      if (cost < best.cost) {
+        best = s;
+        best.bin = b;
+        best.cost = cost;
+      }
+    }
+  }
+  return best;
+}
+
+// The bounds of the part of r between a and b along axis, padded so that
+// rounding in the slab test cannot open a crack where a primitive was cut.
+// Triangles are clipped; anything else just has its box cut. False if
+// nothing is left.
+bool Builder::clip(const BuildRef &r, int axis, double a, double b,
+                   BuildRef &piece) const {
+  glm::dvec3 lo = r.lo, hi = r.hi;
+  if (r.face) {
+    // The clipped polygon's corners are the triangle's corners inside the
+    // slab and the points where its edges cross the slab's planes.
+    glm::dvec3 v[3] = {r.face->vertex(0), r.face->vertex(1),
+                       r.face->vertex(2)};
+    glm::dvec3 plo(1.0e308), phi(-1.0e308);
+    for (int k = 0; k < 3; k++) {
+      const glm::dvec3 &p = v[k], &q = v[(k + 1) % 3];
+      if (a <= p[axis] && p[axis] <= b) {
+        plo = glm::min(plo, p);
+        phi = glm::max(phi, p);
+      }
+      for (double plane : {a, b}) {
+        if ((p[axis] < plane) == (q[axis] < plane))
+          continue;
+        glm::dvec3 x = p + (q - p) * ((plane - p[axis]) / (q[axis] - p[axis]));
+        x[axis] = plane;
+        plo = glm::min(plo, x);
+        phi = glm::max(phi, x);
+      }
+    }
+    lo = glm::max(lo, plo);
+    hi = glm::min(hi, phi);
+  }
+  lo[axis] = std::max(lo[axis], a);
+  hi[axis] = std::min(hi[axis], b);
+  if (lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2])
+    return false;
+  piece = r;
+  piece.lo = lo - pad;
+  piece.hi = hi + pad;
+  piece.c = 0.5 * (piece.lo + piece.hi);
+  return true;
+}
+
+int Builder::lbvh(const BoundingBox &sceneBounds) {
+  // 21 bits per axis over the scene bounds
+  glm::dvec3 lo = sceneBounds.getMin();
+  glm::dvec3 extent = sceneBounds.getMax() - lo;
+  glm::dvec3 scale;
+  for (int a = 0; a < 3; a++)
+    scale[a] = extent[a] > 0.0 ? 2097151.0 / extent[a] : 0.0;
+
+  std::vector<std::pair<uint64_t, int>> keys(refs.size());
+  for (size_t k = 0; k < refs.size(); k++) {
+    uint64_t cell[3];
+    for (int a = 0; a < 3; a++) {
+      double c = (refs[k].c[a] - lo[a]) * scale[a];
+      cell[a] = (uint64_t)std::max(0.0, std::min(2097151.0, c));
+    }
+    keys[k] = {morton3D_64(cell[0], cell[1], cell[2]), (int)k};
+  }
+  radixSort(keys, opt.threads);
+
+  std::vector<BuildRef> sorted(refs.size());
+  codes.resize(refs.size());
+  for (size_t k = 0; k < refs.size(); k++) {
+    sorted[k] = refs[keys[k].second];
+    codes[k] = keys[k].first;
+  }
+  refs.swap(sorted);
+  return emit(0, (int)refs.size(), 62, 0);
+}
+
+// Split [begin, end) of the sorted codes where the highest bit that differs
+// within the range turns from 0 to 1.
+int Builder::emit(int begin, int end, int bit, int depth) {
+  int count = end - begin;
+  if (count <= opt.leafSize || depth >= opt.maxDepth)
+    return leaf(begin, end);
+
+  uint64_t diff = codes[begin] ^ codes[end - 1];
+  while (bit >= 0 && !(diff >> bit & 1))
+    bit--;
+  int mid;
+  if (bit < 0) {
+    mid = begin + count / 2; // identical codes: just halve the range
+  } else {
+    uint64_t mask = 1ull << bit;
+    mid = (int)(std::partition_point(codes.begin() + begin,
+                                     codes.begin() + end,
+                                     [&](uint64_t c) { return !(c & mask); }) -
+                codes.begin());
+  }
+
+  int left = emit(begin, mid, bit - 1, depth + 1);
+  int right = emit(mid, end, bit - 1, depth + 1);
+  return interior(left, right);
+}
+
+void Builder::treelets(int root) {
+  // Children before parents, so each treelet is built from subtrees that
+  // have already been improved.
+  std::vector<int> order, stack(1, root);
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+    order.push_back(n);
+    if (nodes[n].left >= 0) {
+      stack.push_back(nodes[n].left);
+      stack.push_back(nodes[n].right);
+    }
+  }
+  for (auto it = order.rbegin(); it != order.rend(); ++it)
+    if (nodes[*it].left >= 0)
+      optimizeTreelet(*it);
+}
+
+// Grow a treelet of up to TREELET_LEAVES subtrees under root by opening the
+// largest one, find the binary tree over those subtrees with the lowest SAH
+// cost, and rebuild the treelet that way if it beats the current one.
+void Builder::optimizeTreelet(int root) {
+  std::vector<int> leaves = {nodes[root].left, nodes[root].right};
+  std::vector<int> inner = {root};
+  while ((int)leaves.size() < TREELET_LEAVES) {
+    int pick = -1;
+    for (int k = 0; k < (int)leaves.size(); k++)
+      if (nodes[leaves[k]].left >= 0 &&
+          (pick < 0 || area(nodes[leaves[k]].lo, nodes[leaves[k]].hi) >
+                           area(nodes[leaves[pick]].lo, nodes[leaves[pick]].hi)))
+        pick = k;
+    if (pick < 0)
+      break;
+    int n = leaves[pick];
+    inner.push_back(n);
+    leaves[pick] = nodes[n].left;
+    leaves.push_back(nodes[n].right);
+  }
+  int k = (int)leaves.size();
+  if (k < 3)
+    return; // two subtrees can only be arranged one way
+
+  int full = (1 << k) - 1;
+  std::vector<double> cost(full + 1), surface(full + 1);
+  std::vector<int> split(full + 1, 0);
+  for (int s = 1; s <= full; s++) {
+    glm::dvec3 lo(1.0e308), hi(-1.0e308);
+    for (int b = 0; b < k; b++)
+      if (s >> b & 1) {
+        lo = glm::min(lo, nodes[leaves[b]].lo);
+        hi = glm::max(hi, nodes[leaves[b]].hi);
+      }
+    surface[s] = area(lo, hi);
+  }
+  for (int s = 1; s <= full; s++) {
+    if ((s & (s - 1)) == 0) {
+      int b = 0;
+      while (!(s >> b & 1))
+        b++;
+      cost[s] = nodes[leaves[b]].cost;
+      continue;
+    }
+    // Sets are visited in increasing order, so every proper subset of s
+    // already has its cost. Only halves holding s's lowest bit are tried,
+    // to see each partition once.
+    int low = s & -s;
+    double best = 1.0e308;
+    for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+      if (!(p & low))
+        continue;
+      double c = cost[p] + cost[s ^ p];
+      if (c < best) {
+        best = c;
+        split[s] = p;
+      }
+    }
+    cost[s] = surface[s] + best;
+  }
+  if (cost[full] >= nodes[root].cost * (1.0 - 1.0e-9))
+    return;
+
+  // Rebuild with the same node numbers, root first
+  size_t next = 0;
+  std::function<int(int)> rebuild = [&](int s) -> int {
+    if ((s & (s - 1)) == 0) {
+      int b = 0;
+      while (!(s >> b & 1))
+        b++;
+      return leaves[b];
+    }
+    int n = inner[next++];
+    int l = rebuild(split[s]);
+    int r = rebuild(s ^ split[s]);
+    BuildNode &node = nodes[n];
+    node.left = l;
+    node.right = r;
+    node.lo = glm::min(nodes[l].lo, nodes[r].lo);
+    node.hi = glm::max(nodes[l].hi, nodes[r].hi);
+    node.cost = surface[s] + nodes[l].cost + nodes[r].cost;
+    return n;
+  };
+  rebuild(full);
+}
+
+// BoundingBox::intersect() against a node's box, also returning where the
+// ray enters it. The box is rounded outwards from the primitives' boxes and
+// the arithmetic is the same, so a node never turns away a ray that one of
+// its primitives' boxes would take.
+inline bool slab(const float *lo, const float *hi, const glm::dvec3 &o,
+                 const glm::dvec3 &d, double &tNear) {
+  double tMin = -1.0e308, tMax = 1.0e308;
+  for (int a = 0; a < 3; a++) {
+    double vd = d[a];
+    if (vd == 0.0)
+      continue;
+    double t1 = (lo[a] - o[a]) / vd;
+    double t2 = (hi[a] - o[a]) / vd;
+    if (t1 > t2)
+      std::swap(t1, t2);
+    if (t1 > tMin)
+      tMin = t1;
+    if (t2 < tMax)
+      tMax = t2;
+    if (tMin > tMax || tMax < RAY_EPSILON)
+      return false;
+  }
+  tNear = tMin;
+  return true;
+}
+
+// The nearest float at or below (above) x.
+inline float roundDown(double x) {
+  float f = (float)x;
+  return f > x ? std::nextafter(f, -INFINITY) : f;
+}
+inline float roundUp(double x) {
+  float f = (float)x;
+  return f < x ? std::nextafter(f, INFINITY) : f;
+}
+
+// Could a node the ray enters at tNear hold a hit that beats best, or for
+// an any-hit search that has none yet, one before best.tMax? Hits are found
+// in local space and scaled back, so allow for a little rounding.
+inline bool reachable(double tNear, const PrimHit &best) {
+  if (best.done())
+    return false;
+  double t = best.order < 0 ? best.tMax : best.i.getT();
+  return tNear <= t + 1.0e-9 * (1.0 + std::fabs(t));
+}
+
+} // anonymous namespace
+
+BVHOptions BVH::clamped(const BVHOptions &options) {
+  BVHOptions opt = options;
+  opt.maxDepth = std::max(1, std::min(opt.maxDepth, STACK_SIZE - 2));
+  opt.leafSize = std::max(1, opt.leafSize);
+  return opt;
+}
+
+BVH::BVH(PrimitiveSet &prims, const BoundingBox &sceneBounds,
+         const BVHOptions &options)
+    : opt(clamped(options)) {
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<BuildRef> refs;
+  std::vector<PrimRef> unbounded;
+  for (const PrimRef &r : prims.refs()) {
+    const Primitive &p = prims[r];
+    if (!p.bounded) {
+      unbounded.push_back(r);
+      continue;
+    }
+    BuildRef b;
+    b.lo = p.bounds.getMin();
+    b.hi = p.bounds.getMax();
+    b.c = 0.5 * (b.lo + b.hi);
+    b.ref = r;
+    b.face = r.type == PRIM_TRIANGLE ? p.face : nullptr;
+    refs.push_back(b);
+  }
+  primCount = refs.size();
+
+  Builder builder(refs, opt);
+  int root = -1;
+  if (!refs.empty()) {
+    if (opt.builder == BVH_LBVH)
+      root = builder.lbvh(sceneBounds);
+    else if (opt.builder == BVH_SBVH)
+      root = builder.sbvh();
+    else
+      root = builder.sah(0, (int)refs.size(), 0);
+    if (opt.treelets)
+      builder.treelets(root);
+  }
+
+  // Flatten depth first, so a node's left child follows it, and gather the
+  // leaves' primitives in the same order. The treelet pass and spatial
+  // splits can take a tree past maxDepth, so a subtree that would reach
+  // deeper than the traversal stack allows is flattened into one leaf.
+  std::vector<PrimRef> leafRefs;
+  std::vector<int> groupStart(1, 0);
+  std::vector<int> leafNodes;
+  if (root >= 0) {
+    struct Pending {
+      int node;   // in builder.nodes
+      int parent; // in nodes, or -1 for the root and left children
+      int depth;
+    };
+    std::vector<Pending> stack = {{root, -1, 0}};
+    while (!stack.empty()) {
+      Pending p = stack.back();
+      stack.pop_back();
+      const BuildNode &bn = builder.nodes[p.node];
+      int n = (int)nodes.size();
+      nodes.emplace_back();
+      Node &node = nodes.back();
+      for (int a = 0; a < 3; a++) {
+        node.lo[a] = roundDown(bn.lo[a]);
+        node.hi[a] = roundUp(bn.hi[a]);
+      }
+      node.offset = 0;
+      node.count = 0;
+      node.axis = 0;
+      if (p.parent >= 0)
+        nodes[p.parent].offset = n;
+      if (bn.left >= 0 && p.depth <= STACK_SIZE - 2) {
+        // Order the children along the axis that separates them best, so
+        // the ray direction's sign says which is nearer.
+        int left = bn.left, right = bn.right;
+        glm::dvec3 gap = (builder.nodes[right].lo + builder.nodes[right].hi) -
+                         (builder.nodes[left].lo + builder.nodes[left].hi);
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+          if (std::fabs(gap[a]) > std::fabs(gap[axis]))
+            axis = a;
+        if (gap[axis] < 0.0)
+          std::swap(left, right);
+        node.axis = axis;
+        // Popped last-in first-out: push the right child first
+        stack.push_back({right, n, p.depth + 1});
+        stack.push_back({left, -1, p.depth + 1});
+      } else if (bn.left >= 0) {
+        // Too deep: every primitive under here, each once
+        size_t first = leafRefs.size();
+        std::vector<int> under = {p.node};
+        while (!under.empty()) {
+          const BuildNode &u = builder.nodes[under.back()];
+          under.pop_back();
+          if (u.left >= 0) {
+            under.push_back(u.right);
+            under.push_back(u.left);
+            continue;
+          }
+          for (int k = u.first; k < u.first + u.count; k++)
+            leafRefs.push_back(refs[k].ref);
+        }
+        auto byRef = [](const PrimRef &a, const PrimRef &b) {
+          return a.type != b.type ? a.type < b.type : a.index < b.index;
+        };
+        auto sameRef = [](const PrimRef &a, const PrimRef &b) {
+          return a.type == b.type && a.index == b.index;
+        };
+        std::sort(leafRefs.begin() + first, leafRefs.end(), byRef);
+        leafRefs.erase(
+            std::unique(leafRefs.begin() + first, leafRefs.end(), sameRef),
+            leafRefs.end());
+        leafNodes.push_back(n);
+        groupStart.push_back((int)leafRefs.size());
+      } else {
+        leafNodes.push_back(n);
+        for (int k = bn.first; k < bn.first + bn.count; k++)
+          leafRefs.push_back(refs[k].ref);
+        groupStart.push_back((int)leafRefs.size());
+      }
+    }
+  }
+  if (!unbounded.empty()) {
+    leafRefs.insert(leafRefs.end(), unbounded.begin(), unbounded.end());
+    groupStart.push_back((int)leafRefs.size());
+  }
+  std::vector<int> rangeStart;
+  prims.regroup(leafRefs, groupStart, ranges, rangeStart);
+  for (size_t g = 0; g < leafNodes.size(); g++) {
+    nodes[leafNodes[g]].offset = rangeStart[g];
+    nodes[leafNodes[g]].count = rangeStart[g + 1] - rangeStart[g];
+  }
+  if (!unbounded.empty()) {
+    alwaysBegin = rangeStart[leafNodes.size()];
+    alwaysEnd = rangeStart[leafNodes.size() + 1];
+  }
+
+  buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+}
+
+BVHStats BVH::stats() const {
+  BVHStats s;
+  s.nodes = nodes.size();
+  s.primitives = primCount;
+  s.buildSeconds = buildTime;
+  if (nodes.empty())
+    return s;
+  auto nodeArea = [](const Node &n) {
+    return area(glm::dvec3(n.lo[0], n.lo[1], n.lo[2]),
+                glm::dvec3(n.hi[0], n.hi[1], n.hi[2]));
+  };
+  double rootArea = std::max(nodeArea(nodes[0]), 1.0e-300);
+  for (const Node &n : nodes) {
+    double a = nodeArea(n) / rootArea;
+    if (!n.count) {
+      s.sahCost += a;
+      continue;
+    }
+    size_t count = 0;
+    for (int k = n.offset; k < n.offset + (int)n.count; k++)
+      count += ranges[k].end - ranges[k].begin;
+    s.leaves++;
+    s.references += count;
+    s.sahCost += a * count;
+  }
+  return s;
+}
+
+void BVH::intersect(const PrimitiveSet &prims, ray &r, PrimHit &best,
+                    const BVHCut *cut) const {
+  walk<false>(prims, r, best, cut, nullptr);
+}
+
+void BVH::countSteps(const PrimitiveSet &prims, ray &r, PrimHit &best,
+                     size_t steps[2]) const {
+  walk<true>(prims, r, best, nullptr, steps);
+}
+
+void BVH::cull(const PrimitiveSet &prims, const Frustum &frustum,
+               BVHCut &cut) const {
+  cut.roots.clear();
+  cut.ranges.clear();
+  if (nodes.empty())
+    return;
+
+  auto toBox = [](const Node &n) {
+    return BoundingBox(glm::dvec3(n.lo[0], n.lo[1], n.lo[2]),
+                       glm::dvec3(n.hi[0], n.hi[1], n.hi[2]));
+  };
+  std::pair<int, int> stack[CULL_LEVELS + 2]; // node, level
+  int sp = 0;
+  stack[sp++] = {0, 0};
+  while (sp) {
+    std::pair<int, int> top = stack[--sp];
+    const Node &n = nodes[top.first];
+    BoundingBox box = toBox(n);
+    if (!frustum.intersects(box))
+      continue;
+    if (frustum.contains(box) || (!n.count && top.second == CULL_LEVELS)) {
+      cut.roots.push_back(top.first);
+      continue;
+    }
+    if (n.count) {
+      // Split the leaf's runs around the primitives outside
+      for (int k = n.offset; k < n.offset + (int)n.count; k++) {
+        const PrimRange &run = ranges[k];
+        const std::vector<Primitive> &of = prims.ofType(run.type);
+        int begin = run.begin;
+        for (int p = run.begin; p <= run.end; p++) {
+          if (p < run.end && frustum.intersects(of[p].bounds))
+            continue;
+          if (begin < p)
+            cut.ranges.push_back({run.type, begin, p});
+          begin = p + 1;
+        }
+      }
+      continue;
+    }
+    // Right first, so the roots come out in tree order
+    stack[sp++] = {n.offset, top.second + 1};
+    stack[sp++] = {top.first + 1, top.second + 1};
+  }
+}
+
+template <bool Count>
+void BVH::walk(const PrimitiveSet &prims, ray &r, PrimHit &best,
+               const BVHCut *cut, size_t *steps) const {
+  auto testRuns = [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      if (Count)
+        steps[1] += ranges[k].end - ranges[k].begin;
+      prims.intersect(ranges[k].type, ranges[k].begin, ranges[k].end, r, best);
+    }
+  };
+  testRuns(alwaysBegin, alwaysEnd);
+  if (nodes.empty())
+    return;
+
+  const int whole = 0;
+  const int *root = &whole, *last = &whole + 1;
+  if (cut) {
+    for (const PrimRange &run : cut->ranges) {
+      if (Count)
+        steps[1] += run.end - run.begin;
+      prims.intersect(run.type, run.begin, run.end, r, best);
+    }
+    root = cut->roots.data();
+    last = root + cut->roots.size();
+  }
+
+  glm::dvec3 o = r.getPosition(), d = r.getDirection();
+  int stack[STACK_SIZE];
+  for (; root != last; root++) {
+    int sp = 0;
+    stack[sp++] = *root;
+    while (sp) {
+      const Node &n = nodes[stack[--sp]];
+      double tNear;
+      if (!slab(n.lo, n.hi, o, d, tNear) || !reachable(tNear, best))
+        continue;
+      if (Count)
+        steps[0]++;
+      if (n.count) {
+        testRuns(n.offset, n.offset + n.count);
+        continue;
+      }
+      // Push the far child first so the near one is searched first
+      int left = int(&n - nodes.data()) + 1;
+      if (d[n.axis] < 0.0) {
+        stack[sp++] = left;
+        stack[sp++] = n.offset;
+      } else {
+        stack[sp++] = n.offset;
+        stack[sp++] = left;
+      }
+    }
+  }
+}
+
+void BVH::intersect(const PrimitiveSet &prims, const RayPacket &P,
+                    PrimHit *best, const BVHCut *cut) const {
+  RayPacket Q = P;
+  auto testRuns = [&](int begin, int end, unsigned mask) {
+    for (int k = 0; k < P.size; k++)
+      Q.active[k] = (mask >> k) & 1;
+    for (int k = begin; k < end; k++)
+      prims.intersect(ranges[k].type, ranges[k].begin, ranges[k].end, Q,
+                      best);
+  };
+
+  unsigned all = 0;
+  int first = -1; // the first active lane orders the children
+  for (int k = 0; k < P.size; k++) {
+    all |= unsigned(P.active[k] != 0) << k;
+    if (P.active[k] && first < 0)
+      first = k;
+  }
+  if (!all)
+    return;
+  if (alwaysBegin < alwaysEnd)
+    testRuns(alwaysBegin, alwaysEnd, all);
+  if (nodes.empty())
+    return;
+  glm::dvec3 dir = P.getDirection(first);
+
+  const int whole = 0;
+  const int *root = &whole, *last = &whole + 1;
+  if (cut) {
+    for (const PrimRange &run : cut->ranges)
+      prims.intersect(run.type, run.begin, run.end, P, best);
+    root = cut->roots.data();
+    last = root + cut->roots.size();
+  }
+  std::pair<int, unsigned> stack[STACK_SIZE];
+  for (; root != last; root++) {
+    int sp = 0;
+    stack[sp++] = {*root, all};
+    while (sp) {
+      std::pair<int, unsigned> top = stack[--sp];
+      const Node &n = nodes[top.first];
+
+      // Lanes that still reach this node
+      unsigned mask = 0;
+      for (int k = 0; k < P.size; k++) {
+        if (!(top.second >> k & 1))
+          continue;
+        double tNear;
+        if (slab(n.lo, n.hi, P.getPosition(k), P.getDirection(k), tNear) &&
+            reachable(tNear, best[k]))
+          mask |= 1u << k;
+      }
+      if (!mask)
+        continue;
+      if (n.count) {
+        testRuns(n.offset, n.offset + n.count, mask);
+        continue;
+      }
+      int left = top.first + 1;
+      if (dir[n.axis] < 0.0) {
+        stack[sp++] = {left, mask};
+        stack[sp++] = {n.offset, mask};
+      } else {
+        stack[sp++] = {n.offset, mask};
+        stack[sp++] = {left, mask};
+      }
+    }
+  }
+}
@@ -0,0 +1,133 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over the scene's primitives. Leaves hold typed
+// runs of the PrimitiveSet, so each leaf is tested with the same per-type
+// kernels as the flat loop.
+//
+// Three builders:
+//   BVH_SAH   top-down, splitting at the best of 16 bins by the surface area
+//             heuristic. Slower to build, faster to trace.
+//   BVH_LBVH  sorts the primitives by the Morton code of their centroids and
+//             splits where the leading code bit changes. Builds in a couple
+//             of linear passes, for when rebuild time matters more.
+//   BVH_SBVH  BVH_SAH, but where the two halves of a split would overlap it
+//             also tries cutting the node with a plane, clipping triangles
+//             that cross it into both halves. Helps meshes with long thin
+//             triangles, at the cost of some duplicate references.
+// Either can be followed by a treelet pass that rearranges small groups of
+// nodes into the arrangement with the lowest SAH cost.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "bbox.h"
+#include "primitives.h"
+#include "ray.h"
+#include "raypacket.h"
+
+#include <glm/vec3.hpp>
+#include <stdint.h>
+#include <vector>
+
+class Frustum;
+
+enum BVHBuilder { BVH_SAH = 0, BVH_LBVH = 1, BVH_SBVH = 2 };
+
+struct BVHOptions {
+  int builder = BVH_SAH;    // BVHBuilder
+  int maxDepth = 15;        // deeper nodes become leaves
+  int leafSize = 10;        // most primitives in a leaf, depth permitting
+  bool treelets = false;    // run the treelet pass?
+  double splitBudget = 0.3; // SBVH: duplicates allowed, per primitive
+  int threads = 1;          // for the Morton code sort
+
+  bool operator==(const BVHOptions &o) const {
+    return builder == o.builder && maxDepth == o.maxDepth &&
+           leafSize == o.leafSize && treelets == o.treelets &&
+           splitBudget == o.splitBudget;
+  }
+  bool operator!=(const BVHOptions &o) const { return !(*this == o); }
+};
+
+// What BVH::cull() leaves of a tree for one frustum: subtrees to search as
+// usual, and the runs of primitives inside it from leaves it only partly
+// overlaps.
+struct BVHCut {
+  std::vector<int> roots;
+  std::vector<PrimRange> ranges;
+};
+
+// What a tree looks like, for comparing builders.
+struct BVHStats {
+  size_t nodes = 0, leaves = 0;
+  size_t primitives = 0; // bounded primitives the tree was built over
+  size_t references = 0; // leaf entries; more than primitives after splits
+  double sahCost = 0.0;  // expected node visits plus primitive tests for a
+                         // ray through the root, by surface area
+  double buildSeconds = 0.0;
+  // Averages over camera rays, filled in by Scene::measureAccelerator()
+  double nodesPerRay = 0.0;
+  double primsPerRay = 0.0;
+};
+
+class BVH {
+public:
+  // Build over every bounded primitive of prims, regrouping prims into leaf
+  // order. Unbounded primitives are kept aside and tested for every ray.
+  BVH(PrimitiveSet &prims, const BoundingBox &sceneBounds,
+      const BVHOptions &opt);
+
+  // Fold the closest hit in the tree into best. With a cut, only search
+  // what cull() left.
+  void intersect(const PrimitiveSet &prims, ray &r, PrimHit &best,
+                 const BVHCut *cut = nullptr) const;
+  void intersect(const PrimitiveSet &prims, const RayPacket &P, PrimHit *best,
+                 const BVHCut *cut = nullptr) const;
+
+  // The parts of the tree a ray inside the frustum could reach. Nodes are
+  // tested down to CULL_LEVELS below the root; one wholly inside, or at
+  // that depth, is kept whole. A leaf the frustum cuts is replaced by its
+  // primitives whose bounds it touches.
+  void cull(const PrimitiveSet &prims, const Frustum &frustum,
+            BVHCut &cut) const;
+
+  // intersect(), also adding the nodes visited to steps[0] and the
+  // primitives tested to steps[1].
+  void countSteps(const PrimitiveSet &prims, ray &r, PrimHit &best,
+                  size_t steps[2]) const;
+
+  // The options a tree is built with: opt, with the depth and leaf size
+  // brought into the range the builders and the traversal stack can take.
+  static BVHOptions clamped(const BVHOptions &opt);
+
+  const BVHOptions &options() const { return opt; } // clamped
+  size_t nodeCount() const { return nodes.size(); }
+  double buildSeconds() const { return buildTime; }
+  BVHStats stats() const;
+
+private:
+  // 32 bytes, so two share a cache line. The bounds are rounded outwards
+  // to float. An interior node's left child is the next node.
+  struct alignas(32) Node {
+    float lo[3], hi[3];
+    int32_t offset;      // interior: the right child; leaf: its first run
+    uint32_t count : 30; // runs in ranges for a leaf, 0 for interior nodes
+    uint32_t axis : 2;   // interior: the left child is the lower on this axis
+  };
+  static_assert(sizeof(Node) == 32, "BVH nodes should be 32 bytes");
+
+  template <bool Count>
+  void walk(const PrimitiveSet &prims, ray &r, PrimHit &best,
+            const BVHCut *cut, size_t *steps) const;
+
+  BVHOptions opt;
+  std::vector<Node> nodes; // depth first, root at 0
+  std::vector<PrimRange> ranges;
+  int alwaysBegin = 0, alwaysEnd = 0; // runs of unbounded primitives
+  size_t primCount = 0;
+  double buildTime = 0.0;
+};
+
+#endif // __BVH_H__
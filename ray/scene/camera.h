@@ -8,7 +8,7 @@
 class Camera {
 public:
   Camera();
-  void rayThrough(double x, double y, ray &r);
+  void rayThrough(double x, double y, ray &r) const;
   void setEye(const glm::dvec3 &eye);
   void setLook(double, double, double, double);
   void setLook(const glm::dvec3 &viewDir, const glm::dvec3 &upDir);
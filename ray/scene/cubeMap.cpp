@@ -2,9 +2,11 @@
 #include "../scene/material.h"
 #include "../ui/TraceUI.h"
 #include "ray.h"
+#include <algorithm>
+#include <cmath>
 extern TraceUI *traceUI;
 
-glm::dvec3 CubeMap::getColor(ray r) const {
+glm::dvec3 CubeMap::getColor(const ray &r, int filterWidth) const {
   // YOUR CODE HERE
   // FIXME: Implement Cube Map here
 
@@ -56,14 +58,75 @@ glm::dvec3 CubeMap::getColor(ray r) const {
   if (!tMap[face])
     return glm::dvec3(1.0, 1.0, 1.0); 
 
+  if (filterWidth > 1 && !sumTable(face).sums.empty())
+    return boxFilter(face, u, v, filterWidth);
   return tMap[face]->getMappedValue(glm::dvec2(u, v));
 }
 
+const CubeMap::SumTable &CubeMap::sumTable(int face) const {
+  SumTable &t = *tables[face];
+  std::call_once(t.built, [&] {
+    const TextureMap &map = *tMap[face];
+    int w = map.getWidth(), h = map.getHeight();
+    // Sums must fit 32 bits, which holds for faces up to 4096 x 4096; past
+    // that the face is left to the unfiltered lookup.
+    if (w <= 0 || h <= 0 || (double)w * h * 255.0 > 4294967295.0)
+      return;
+    t.width = w;
+    t.height = h;
+    t.sums.assign((size_t)(w + 1) * (h + 1) * 3, 0);
+    size_t row = (size_t)(w + 1) * 3;
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) {
+        glm::dvec3 texel = map.getPixelAt(x, y);
+        uint32_t *s = &t.sums[(y + 1) * row + (x + 1) * 3];
+        for (int c = 0; c < 3; c++)
+          s[c] = (uint32_t)std::lround(texel[c] * 255.0) + s[c - 3] +
+                 s[c - row] - s[c - row - 3];
+      }
+  });
+  return t;
+}
+
+// Treat each texel as a unit square, texel x covering [x, x + 1), so a
+// lookup at u sits at u * (width - 1) + 0.5 just as getMappedValue() puts
+// it on the texel centres. Between entries of the table the sum of the
+// texels below and left of a point is exactly the bilinear blend of the four
+// around it, so a box with fractional edges costs four such blends.
+glm::dvec3 CubeMap::boxFilter(int face, double u, double v,
+                              int filterWidth) const {
+  const SumTable &t = *tables[face];
+  size_t row = (size_t)(t.width + 1) * 3;
+  auto integral = [&](double x, double y) {
+    int i = std::min((int)x, t.width - 1);
+    int j = std::min((int)y, t.height - 1);
+    double fx = x - i, fy = y - j;
+    const uint32_t *s = &t.sums[j * row + i * 3];
+    glm::dvec3 sum;
+    for (int c = 0; c < 3; c++)
+      sum[c] = (1 - fy) * ((1 - fx) * s[c] + fx * s[c + 3]) +
+               fy * ((1 - fx) * s[c + row] + fx * s[c + row + 3]);
+    return sum;
+  };
+
+  // The box stops at the edge of the face rather than wrapping onto the next
+  double half = 0.5 * filterWidth;
+  double x = std::clamp(u, 0.0, 1.0) * (t.width - 1) + 0.5;
+  double y = std::clamp(v, 0.0, 1.0) * (t.height - 1) + 0.5;
+  double x0 = std::max(0.0, x - half), x1 = std::min((double)t.width, x + half);
+  double y0 = std::max(0.0, y - half), y1 = std::min((double)t.height, y + half);
+  glm::dvec3 sum = integral(x1, y1) - integral(x0, y1) - integral(x1, y0) +
+                   integral(x0, y0);
+  return sum / ((x1 - x0) * (y1 - y0) * 255.0);
+}
+
 CubeMap::CubeMap() {}
 
 CubeMap::~CubeMap() {}
 
 void CubeMap::setNthMap(int n, TextureMap *m) {
-  if (m != tMap[n].get())
+  if (m != tMap[n].get()) {
     tMap[n].reset(m);
+    tables[n].reset(new SumTable);
+  }
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <glm/vec3.hpp>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 class TextureMap;
 class ray;
@@ -9,6 +12,20 @@ class ray;
 class CubeMap {
   std::unique_ptr<TextureMap> tMap[6];
 
+  // Summed-area table of a face: entry (x, y) holds the sum of every texel
+  // left of column x and below row y, per channel, in 0-255 units. Built the
+  // first time the face is box filtered, since it takes 12 bytes a texel.
+  // Replaced along with the face's map.
+  struct SumTable {
+    std::once_flag built;
+    int width = 0, height = 0;
+    std::vector<uint32_t> sums; // (width + 1) x (height + 1) x 3
+  };
+  std::unique_ptr<SumTable> tables[6];
+
+  const SumTable &sumTable(int face) const;
+  glm::dvec3 boxFilter(int face, double u, double v, int filterWidth) const;
+
 public:
   CubeMap();
   ~CubeMap();
@@ -22,5 +39,8 @@ public:
 
   void setNthMap(int n, TextureMap *m);
 
-  glm::dvec3 getColor(ray r) const;
+  // The background seen along r. With filterWidth above 1 this is the
+  // average of a filterWidth x filterWidth square of texels around the
+  // lookup, at the same cost whatever the width.
+  glm::dvec3 getColor(const ray &r, int filterWidth = 1) const;
 };
@@ -0,0 +1,55 @@
+#include "frustum.h"
+#include "bbox.h"
+#include "camera.h"
+
+#include <glm/glm.hpp>
+
+Frustum::Frustum(const Camera &camera, double x0, double y0, double x1,
+                 double y1)
+    : apex(camera.getEye()) {
+  // Directions through the four corners, in the same form as rayThrough()
+  auto corner = [&](double x, double y) {
+    return camera.getLook() + (x - 0.5) * camera.getU() +
+           (y - 0.5) * camera.getV();
+  };
+  glm::dvec3 c[4] = {corner(x0, y0), corner(x1, y0), corner(x1, y1),
+                     corner(x0, y1)};
+  glm::dvec3 center = corner(0.5 * (x0 + x1), 0.5 * (y0 + y1));
+
+  for (int e = 0; e < 4; e++) {
+    glm::dvec3 n = glm::cross(c[e], c[(e + 1) % 4]);
+    if (glm::dot(n, center) < 0.0)
+      n = -n;
+    normal[e] = n;
+  }
+}
+
+bool Frustum::intersects(const BoundingBox &box) const {
+  glm::dvec3 bmin = box.getMin() - apex;
+  glm::dvec3 bmax = box.getMax() - apex;
+  for (int e = 0; e < 4; e++) {
+    // The box corner furthest along the plane normal
+    const glm::dvec3 &n = normal[e];
+    glm::dvec3 p(n[0] >= 0.0 ? bmax[0] : bmin[0],
+                 n[1] >= 0.0 ? bmax[1] : bmin[1],
+                 n[2] >= 0.0 ? bmax[2] : bmin[2]);
+    if (glm::dot(n, p) < 0.0)
+      return false;
+  }
+  return true;
+}
+
+bool Frustum::contains(const BoundingBox &box) const {
+  glm::dvec3 bmin = box.getMin() - apex;
+  glm::dvec3 bmax = box.getMax() - apex;
+  for (int e = 0; e < 4; e++) {
+    // The box corner least far along the plane normal
+    const glm::dvec3 &n = normal[e];
+    glm::dvec3 p(n[0] >= 0.0 ? bmin[0] : bmax[0],
+                 n[1] >= 0.0 ? bmin[1] : bmax[1],
+                 n[2] >= 0.0 ? bmin[2] : bmax[2]);
+    if (glm::dot(n, p) < 0.0)
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,33 @@
+//
+// frustum.h
+//
+// The pyramid of camera rays through a rectangle of the image plane.
+//
+
+#ifndef __FRUSTUM_H__
+#define __FRUSTUM_H__
+
+#include <glm/vec3.hpp>
+
+class BoundingBox;
+class Camera;
+
+class Frustum {
+public:
+  // Every ray Camera::rayThrough(x, y) with x in [x0, x1] and y in [y0, y1]
+  // lies inside this frustum.
+  Frustum(const Camera &camera, double x0, double y0, double x1, double y1);
+
+  // Could the box be touched by any ray in the frustum? May answer true for
+  // boxes just outside, never false for a box that is inside.
+  bool intersects(const BoundingBox &box) const;
+
+  // Is every point of the box inside? Never true for a box partly outside.
+  bool contains(const BoundingBox &box) const;
+
+private:
+  glm::dvec3 apex;
+  glm::dvec3 normal[4]; // inward-facing side planes through the apex
+};
+
+#endif // __FRUSTUM_H__
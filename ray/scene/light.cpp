@@ -16,9 +16,8 @@ double DirectionalLight::distanceAttenuation(const glm::dvec3 &) const {
 glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r, const glm::dvec3 &p) const {
   // YOUR CODE HERE:
 
-  isect i;
   ray shadowRay(r);
-  if (scene->intersect(shadowRay, i)&& i.getT() > RAY_EPSILON){ 
+  if (scene->occluded(shadowRay, 1.0e308, occluders[ray_thread_id])) {
 	// The point is in shadow, return the attenuation factor
   //should fix the self shadow issue by checking the intersect point. 
 	return glm::dvec3(0.0,0.0,0.0); 
@@ -26,6 +25,53 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r, const glm::dvec3 &p
   return glm::dvec3(1.0,1.0,1.0);
 }
 
+void Light::clearOccluders() {
+  for (int t = 0; t < MAX_THREADS; t++)
+    occluders[t] = OccluderCache();
+}
+
+size_t Light::uncastShadows() const {
+  size_t n = 0;
+  for (int t = 0; t < MAX_THREADS; t++)
+    n += occluders[t].uncast;
+  return n;
+}
+
+void Light::occluderStats(size_t &queries, size_t &blocked,
+                          size_t &hits) const {
+  queries = blocked = hits = 0;
+  for (int t = 0; t < MAX_THREADS; t++) {
+    queries += occluders[t].queries;
+    blocked += occluders[t].blocked;
+    hits += occluders[t].hits;
+  }
+}
+
+void Light::shadowAttenuationPacket(const RayPacket &P, const glm::dvec3 *pos,
+                                    glm::dvec3 *atten) const {
+  ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), ray::SHADOW);
+  for (int k = 0; k < P.size; k++) {
+    if (!P.active[k])
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    atten[k] = shadowAttenuation(r, pos[k]);
+  }
+}
+
+// Shadow rays towards a directional light are all parallel, so a packet of
+// them stays coherent all the way through the scene.
+void DirectionalLight::shadowAttenuationPacket(const RayPacket &P,
+                                               const glm::dvec3 *,
+                                               glm::dvec3 *atten) const {
+  unsigned char blocked[MAX_PACKET];
+  scene->occluded(P, 1.0e308, occluders[ray_thread_id], blocked);
+  for (int k = 0; k < P.size; k++)
+    if (P.active[k])
+      atten[k] =
+          blocked[k] ? glm::dvec3(0.0, 0.0, 0.0) : glm::dvec3(1.0, 1.0, 1.0);
+}
+
 glm::dvec3 DirectionalLight::getColor() const { return color; }
 
 glm::dvec3 DirectionalLight::getDirection(const glm::dvec3 &) const {
@@ -65,16 +111,12 @@ glm::dvec3 PointLight::shadowAttenuation(const ray &r, const glm::dvec3 &p) cons
   // You should implement shadow-handling code here.
   // to avoid self-shadowing we want it to be offset from the light source aka greater than epsilon.
 
-  isect i;
   ray shadowRay(r);
-  if (scene->intersect(shadowRay, i)){
-	// Check if the intersection is between the point and the light source
-	double lightDist = glm::length(position - p);
-	// Intersect is closer to light source than p, then p is in shadow.
-	if (i.getT() > RAY_EPSILON && i.getT() < lightDist) {
-		// The point is in shadow, return the attenuation factor
-		return glm::dvec3(0.0,0.0,0.0); 
-	}
+  // Only an intersection closer than the light source puts p in shadow.
+  double lightDist = glm::length(position - p);
+  if (scene->occluded(shadowRay, lightDist, occluders[ray_thread_id])) {
+	// The point is in shadow, return the attenuation factor
+	return glm::dvec3(0.0,0.0,0.0); 
   }
 
   return glm::dvec3(1.0,1.0,1.0); 
@@ -8,24 +8,43 @@ using std::min;
 #endif
 
 #include "../ui/TraceUI.h"
+#include "primitives.h"
 #include "scene.h"
 #include <FL/gl.h>
+#include <memory>
 
 class Light : public SceneElement {
 public:
   virtual glm::dvec3 shadowAttenuation(const ray &r,
                                        const glm::dvec3 &pos) const = 0;
+  // shadowAttenuation() for every active lane of a packet of shadow rays;
+  // pos[k] is the surface point lane k starts from. The default tests the
+  // lanes one at a time.
+  virtual void shadowAttenuationPacket(const RayPacket &P,
+                                       const glm::dvec3 *pos,
+                                       glm::dvec3 *atten) const;
   virtual double distanceAttenuation(const glm::dvec3 &P) const = 0;
   virtual glm::dvec3 getColor() const = 0;
   virtual glm::dvec3 getDirection(const glm::dvec3 &P) const = 0;
 
+  // Forget the cached occluders and zero their counts, summed over threads
+  // by occluderStats().
+  void clearOccluders();
+  void occluderStats(size_t &queries, size_t &blocked, size_t &hits) const;
+  // Count a light sample that needed no shadow ray, and read the count.
+  void countUncast() const { occluders[ray_thread_id].uncast++; }
+  size_t uncastShadows() const;
 
 protected:
   Light(Scene *scene, const glm::dvec3 &col)
-      : SceneElement(scene), color(col) {}
+      : SceneElement(scene), color(col),
+        occluders(new OccluderCache[MAX_THREADS]) {}
 
   glm::dvec3 color;
 
+  // The last thing to block a shadow ray from each thread (ray_thread_id)
+  std::unique_ptr<OccluderCache[]> occluders;
+
 public:
   virtual void glDrawLight([[maybe_unused]] GLenum lightID) const {}
   virtual void glDrawLight() const {}
@@ -38,6 +57,9 @@ public:
       : Light(scene, color), orientation(glm::normalize(orien)) {}
   virtual glm::dvec3 shadowAttenuation(const ray &r,
                                        const glm::dvec3 &pos) const;
+  virtual void shadowAttenuationPacket(const RayPacket &P,
+                                       const glm::dvec3 *pos,
+                                       glm::dvec3 *atten) const;
   virtual double distanceAttenuation(const glm::dvec3 &P) const;
   virtual glm::dvec3 getColor() const;
   virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
@@ -65,6 +87,7 @@ public:
   virtual double distanceAttenuation(const glm::dvec3 &P) const;
   virtual glm::dvec3 getColor() const;
   virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
+  const glm::dvec3 &getPosition() const { return position; }
 
   void setAttenuationConstants(float a, float b, float c) {
     constantTerm = a;
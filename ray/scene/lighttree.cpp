@@ -0,0 +1,114 @@
+#include "lighttree.h"
+#include "light.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+LightTree::LightTree(const std::vector<Light *> &lights) {
+  std::vector<Entry> points;
+  for (Light *light : lights) {
+    const PointLight *point = dynamic_cast<const PointLight *>(light);
+    if (!point) {
+      rest.push_back(light);
+      continue;
+    }
+    glm::dvec3 c = point->getColor();
+    double power = std::max(c[0], std::max(c[1], c[2]));
+    points.push_back({point->getPosition(), std::max(0.0, power), point});
+  }
+  count = points.size();
+  if (!points.empty()) {
+    nodes.reserve(2 * points.size() - 1);
+    build(points, 0, (int)points.size());
+  }
+}
+
+// Split at the median along the longest side of the lights' bounds, so the
+// tree stays balanced and a walk down it takes log2 of the lights in steps.
+int LightTree::build(std::vector<Entry> &lights, int begin, int end) {
+  int index = (int)nodes.size();
+  nodes.emplace_back();
+  Node node;
+  node.lo = node.hi = lights[begin].position;
+  node.power = 0.0;
+  for (int k = begin; k < end; k++) {
+    node.lo = glm::min(node.lo, lights[k].position);
+    node.hi = glm::max(node.hi, lights[k].position);
+    node.power += lights[k].power;
+  }
+  node.right = -1;
+  node.light = nullptr;
+
+  if (end - begin == 1) {
+    node.light = lights[begin].light;
+  } else {
+    glm::dvec3 extent = node.hi - node.lo;
+    int axis = extent[0] > extent[1] ? 0 : 1;
+    if (extent[2] > extent[axis])
+      axis = 2;
+    int mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid,
+                     lights.begin() + end,
+                     [axis](const Entry &a, const Entry &b) {
+                       return a.position[axis] < b.position[axis];
+                     });
+    build(lights, begin, mid);
+    node.right = build(lights, mid, end);
+  }
+  nodes[index] = node;
+  return index;
+}
+
+// A guess at how much the lights in node could add at p: their power over
+// the squared distance to the middle of the box, though never closer than
+// half its diagonal. Any guess keeps the estimate unbiased so long as it is
+// zero only where the lights really can't contribute, which is true of a box
+// lying wholly behind the surface.
+double LightTree::importance(const Node &node, const glm::dvec3 &p,
+                             const glm::dvec3 &n) const {
+  if (node.power <= 0.0)
+    return 0.0;
+  bool front = false;
+  for (int c = 0; c < 8 && !front; c++) {
+    glm::dvec3 corner((c & 1) ? node.hi[0] : node.lo[0],
+                      (c & 2) ? node.hi[1] : node.lo[1],
+                      (c & 4) ? node.hi[2] : node.lo[2]);
+    front = glm::dot(n, corner - p) > 0.0;
+  }
+  if (!front)
+    return 0.0;
+  glm::dvec3 centre = 0.5 * (node.lo + node.hi);
+  glm::dvec3 half = 0.5 * (node.hi - node.lo);
+  double d2 = std::max(glm::dot(centre - p, centre - p), glm::dot(half, half));
+  return node.power / std::max(d2, 1e-12);
+}
+
+const Light *LightTree::sample(const glm::dvec3 &p, const glm::dvec3 &n,
+                               double u, double &pdf) const {
+  pdf = 1.0;
+  if (nodes.empty() || importance(nodes[0], p, n) <= 0.0)
+    return nullptr;
+  int k = 0;
+  while (!nodes[k].light) {
+    int left = k + 1, right = nodes[k].right;
+    double wl = importance(nodes[left], p, n);
+    double wr = importance(nodes[right], p, n);
+    if (wl + wr <= 0.0)
+      return nullptr;
+    // Take the left child with probability pl, and stretch u back over
+    // [0, 1) so it can make the next choice too
+    double pl = wl / (wl + wr);
+    if (u < pl) {
+      u /= pl;
+      pdf *= pl;
+      k = left;
+    } else {
+      u = (u - pl) / (1.0 - pl);
+      pdf *= 1.0 - pl;
+      k = right;
+    }
+    u = std::min(u, std::nextafter(1.0, 0.0));
+  }
+  return nodes[k].light;
+}
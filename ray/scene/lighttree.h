@@ -0,0 +1,58 @@
+//
+// lighttree.h
+//
+// A binary tree over the scene's point lights, for scenes with too many of
+// them to shade every one at every hit. Each node holds the bounds of its
+// lights' positions and their total brightness. Walking down from the root
+// and picking a child in proportion to how much it could light a point
+// chooses one light with a known probability; its contribution divided by
+// that probability is an unbiased estimate of all of them together.
+//
+
+#ifndef __LIGHTTREE_H__
+#define __LIGHTTREE_H__
+
+#include <glm/vec3.hpp>
+#include <vector>
+
+class Light;
+
+class LightTree {
+public:
+  // Build over the PointLights in lights. The others are left to others().
+  explicit LightTree(const std::vector<Light *> &lights);
+
+  // The lights not in the tree, which still have to be shaded one by one.
+  const std::vector<Light *> &others() const { return rest; }
+  // Lights in the tree.
+  size_t size() const { return count; }
+
+  // Pick a light for the point p with unit normal n, using u in [0, 1), and
+  // set pdf to the chance it had of being picked. Null if nothing in the
+  // tree is in front of the surface.
+  const Light *sample(const glm::dvec3 &p, const glm::dvec3 &n, double u,
+                      double &pdf) const;
+
+private:
+  struct Node {
+    glm::dvec3 lo, hi;   // bounds of the light positions below
+    double power;        // summed brightest channel of their colours
+    int right;           // interior: the right child; the left is next
+    const Light *light;  // leaf: the light, else null
+  };
+  struct Entry {
+    glm::dvec3 position;
+    double power;
+    const Light *light;
+  };
+
+  int build(std::vector<Entry> &lights, int begin, int end);
+  double importance(const Node &node, const glm::dvec3 &p,
+                    const glm::dvec3 &n) const;
+
+  std::vector<Node> nodes; // depth first, root at 0
+  std::vector<Light *> rest;
+  size_t count = 0;
+};
+
+#endif // __LIGHTTREE_H__
@@ -1,77 +1,210 @@
 #include "material.h"
 #include "../ui/TraceUI.h"
 #include "light.h"
+#include "lighttree.h"
 #include "ray.h"
 extern TraceUI *traceUI;
 
 #include "../fileio/images.h"
+#include <algorithm>
+#include <array>
 #include <glm/gtx/io.hpp>
 #include <iostream>
+#include <string.h> // for memcpy
 
 using namespace std;
 extern bool debugMode;
 
+namespace {
+// Texel byte to [0, 1], the same value as dividing by 255 each time
+const std::array<double, 256> UNIT = [] {
+  std::array<double, 256> unit;
+  for (int k = 0; k < 256; k++)
+    unit[k] = double(k) / 255.0;
+  return unit;
+}();
+} // anonymous namespace
+
 Material::~Material() {}
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
 glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i) const {
+  return shadeKernel<true, true>(scene, r, i);
+}
 
-  // Initialize surfacePoint, normalVector, and viewDirection for use in the Phong model
+// shade() with the debug output and the shadow rays switched on or off at
+// compile time. The renderer picks one of these once per render.
+template <bool Debug, bool Shadows>
+glm::dvec3 Material::shadeKernel(Scene *scene, const ray &r,
+                                 const isect &i) const {
+
+  // Initialize surfacePoint for the shadow tests
   glm::dvec3 surfacePoint = r.at(i);
-  glm::dvec3 normalVector = glm::normalize(i.getN());
-  glm::dvec3 viewDirection = -glm::normalize(r.getDirection());
 
   // Add the emissive and ambient lights to the color
-  glm::dvec3 color = ke(i);
-  color += ka(i) * scene->ambient();
+  glm::dvec3 color = shadeBase(scene, i);
 
   // Debugging
-  if (debugMode) {
-    cerr << "shade: surfacePoint=" << surfacePoint << " normalVector=" << normalVector << " viewDirection=" << viewDirection << " kd=" << kd(i)
+  if (Debug && debugMode) {
+    cerr << "shade: surfacePoint=" << surfacePoint << " normalVector=" << glm::normalize(i.getN())
+         << " viewDirection=" << -glm::normalize(r.getDirection()) << " kd=" << kd(i)
          << " ks=" << ks(i) << " ke=" << ke(i) << " ka=" << ka(i) << "\n";
   }
 
-  // Loop through all the lights in the scene and add their contributions
-  for (const auto &pLight : scene->getAllLights()) {
-    glm::dvec3 lightDirection = glm::normalize(pLight->getDirection(surfacePoint));
-    glm::dvec3 lightColor = pLight->getColor();
-    double distAtt = pLight->distanceAttenuation(surfacePoint);
+  auto addLight = [&](const LightSample &sample) {
+    const Light *pLight = sample.light;
+    if (!Shadows) {
+      if (sample.facing)
+        color += sample.contribution;
+      return;
+    }
+
+    if (!sample.castShadow) {
+      pLight->countUncast();
+      if (sample.facing)
+        color += sample.contribution;
+      return;
+    }
 
     // Create a shadow ray from the surface point towards the light source
-    ray shadowRay(surfacePoint + normalVector * RAY_EPSILON, lightDirection, glm::dvec3(1.0), ray::SHADOW);
+    ray shadowRay(sample.origin, sample.direction, glm::dvec3(1.0), ray::SHADOW);
     glm::dvec3 shadowAtt = pLight->shadowAttenuation(shadowRay, surfacePoint);
 
-    // Get the diffuse contribution
-    double diffuseValue = max(0.0, glm::dot(normalVector, lightDirection));
-    if (diffuseValue > 0.0) {
-      glm::dvec3 diffuse = kd(i) * lightColor * diffuseValue;
+    // Debugging
+    if (Debug && debugMode) {
+      cerr << " light: lightDirection= " << sample.direction << " color= " << pLight->getColor()
+           << " distAtt= " << pLight->distanceAttenuation(surfacePoint) << " shadowAtt= " << shadowAtt << "\n";
+    }
+
+    // The term already carries the distance attenuation; multiply in the shadow attenuation
+    color += sample.contribution * shadowAtt;
+  };
+
+  // Loop through all the lights in the scene and add their contributions,
+  // or with a light tree, the ones outside it and a sample of those in it
+  const LightTree *tree = scene->lightTree();
+  for (const auto &pLight : tree ? tree->others() : scene->getAllLights()) {
+    LightSample sample;
+    lightTerm(pLight, r, i, sample);
+    addLight(sample);
+  }
+  if (tree) {
+    LightSample samples[MAX_LIGHT_SAMPLES];
+    int n = sampleLights(scene, r, i, samples);
+    for (int k = 0; k < n; k++)
+      addLight(samples[k]);
+  }
 
-      // Get the reflection vector for Phong specular
-      glm::dvec3 reflectDirection = glm::reflect(-lightDirection, normalVector);
+  // Clamp the color to the correct range
+  return glm::clamp(color, glm::dvec3(0.0), glm::dvec3(1.0));
+}
 
-      // Get the specular contribution
-      double specularValue = max(0.0, glm::dot(reflectDirection, viewDirection));
-      glm::dvec3 specular = ks(i) * lightColor * pow(specularValue, shininess(i));
+template glm::dvec3 Material::shadeKernel<false, false>(Scene *, const ray &,
+                                                        const isect &) const;
+template glm::dvec3 Material::shadeKernel<false, true>(Scene *, const ray &,
+                                                       const isect &) const;
+template glm::dvec3 Material::shadeKernel<true, false>(Scene *, const ray &,
+                                                       const isect &) const;
+template glm::dvec3 Material::shadeKernel<true, true>(Scene *, const ray &,
+                                                      const isect &) const;
 
-      // Debugging
-      if (debugMode) {
-        cerr << " light: lightDirection= " << lightDirection << " color= " << lightColor << " distAtt= " << distAtt << " shadowAtt= "
-             << shadowAtt << " nDotL= " << diffuseValue << " rDotV= " << specularValue << "\n";
-      }
+glm::dvec3 Material::shadeBase(const Scene *scene, const isect &i) const {
+  glm::dvec3 color = ke(i);
+  color += ka(i) * scene->ambient();
+  return color;
+}
 
-      // Add the diffuse and specular contributions, and multiply them by the 2 attenuations multiplied together
-      glm::dvec3 combinedAtt = shadowAtt * distAtt;
-      color += (diffuse + specular) * combinedAtt;
-    }
+void Material::lightTerm(const Light *light, const ray &r, const isect &i,
+                         LightSample &s) const {
+  // Initialize surfacePoint, normalVector, and viewDirection for use in the Phong model
+  glm::dvec3 surfacePoint = r.at(i);
+  glm::dvec3 normalVector = glm::normalize(i.getN());
+  glm::dvec3 viewDirection = -glm::normalize(r.getDirection());
+
+  glm::dvec3 lightDirection = glm::normalize(light->getDirection(surfacePoint));
+  glm::dvec3 lightColor = light->getColor();
+  double distAtt = light->distanceAttenuation(surfacePoint);
+
+  s.light = light;
+  s.origin = surfacePoint + normalVector * RAY_EPSILON;
+  s.direction = lightDirection;
+  s.contribution = glm::dvec3(0.0);
+
+  // Get the diffuse contribution
+  double diffuseValue = max(0.0, glm::dot(normalVector, lightDirection));
+  s.facing = diffuseValue > 0.0;
+  if (s.facing) {
+    glm::dvec3 diffuse = kd(i) * lightColor * diffuseValue;
+
+    // Get the reflection vector for Phong specular
+    glm::dvec3 reflectDirection = glm::reflect(-lightDirection, normalVector);
+
+    // Get the specular contribution
+    double specularValue = max(0.0, glm::dot(reflectDirection, viewDirection));
+    glm::dvec3 specular = ks(i) * lightColor * pow(specularValue, shininess(i));
+
+    // Add the diffuse and specular contributions, attenuated by distance
+    s.contribution = (diffuse + specular) * distAtt;
   }
 
-  // Clamp the color to the correct range
-  return glm::clamp(color, glm::dvec3(0.0), glm::dvec3(1.0));
+  // A shadow can take away at most the whole contribution, so only look for
+  // one if that could change the colour by more than the scene's cutoff.
+  double most = max(s.contribution[0], max(s.contribution[1], s.contribution[2]));
+  s.castShadow = s.facing && most > light->getScene()->shadowCutoff();
+}
+
+namespace {
+
+// splitmix64: turns consecutive seeds into well spread 64-bit values
+uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+uint64_t bits(double d) {
+  uint64_t b;
+  memcpy(&b, &d, sizeof b);
+  return b;
+}
+
+} // anonymous namespace
+
+int Material::sampleLights(const Scene *scene, const ray &r, const isect &i,
+                           LightSample *out) const {
+  const LightTree *tree = scene->lightTree();
+  int n = scene->lightSamples();
+  if (!tree)
+    return 0;
+
+  // Seeded from the hit point rather than a per-thread generator, so the
+  // picks, and the image, don't depend on which thread shades the hit
+  glm::dvec3 surfacePoint = r.at(i);
+  glm::dvec3 normalVector = glm::normalize(i.getN());
+  uint64_t seed = mix(mix(mix(bits(surfacePoint[0])) ^ bits(surfacePoint[1])) ^
+                      bits(surfacePoint[2]));
+
+  int count = 0;
+  for (int s = 0; s < n; s++) {
+    double u = (mix(seed + s) >> 11) * 0x1.0p-53;
+    double pdf;
+    const Light *light = tree->sample(surfacePoint, normalVector, u, pdf);
+    if (!light)
+      continue; // everything in the tree is behind the surface
+    LightSample &sample = out[count++];
+    lightTerm(light, r, i, sample);
+    sample.contribution /= pdf * n;
+    double most = max(sample.contribution[0],
+                      max(sample.contribution[1], sample.contribution[2]));
+    sample.castShadow = sample.facing && most > scene->shadowCutoff();
+  }
+  return count;
 }
 
 TextureMap::TextureMap(string filename) {
-  data = readImage(filename.c_str(), width, height);
+  std::vector<uint8_t> data = readImage(filename.c_str(), width, height);
   if (data.empty()) {
     width = 0;
     height = 0;
@@ -80,11 +213,26 @@ TextureMap::TextureMap(string filename) {
     error.append("'.");
     throw TextureMapException(error);
   }
+
+  // Rearrange the rows of RGB into tiles (padding the last row and column of
+  // tiles with zeros, which no lookup reaches)
+  tilesAcross = (width + TILE - 1) / TILE;
+  tiles.assign((size_t)tilesAcross * ((height + TILE - 1) / TILE), Tile());
+  for (int y = 0; y < height; y++) {
+    const uint8_t *src = &data[(size_t)y * width * 3];
+    Tile *tile = &tiles[(size_t)(y / TILE) * tilesAcross];
+    for (int x = 0; x < width; x++, src += 3) {
+      uint8_t *texel = tile[x / TILE].texel[(y % TILE) * TILE + x % TILE];
+      texel[0] = src[0];
+      texel[1] = src[1];
+      texel[2] = src[2];
+    }
+  }
 }
 
 glm::dvec3 TextureMap::getMappedValue(const glm::dvec2 &coord) const {
 
-  if (width <= 0 || height <= 0 || data.empty())
+  if (width <= 0 || height <= 0 || tiles.empty())
 	return glm::dvec3(1.0, 1.0, 1.0);
 
   double u = coord.x;
@@ -97,51 +245,42 @@ glm::dvec3 TextureMap::getMappedValue(const glm::dvec2 &coord) const {
   // Get the coordinates of the four surrounding pixels
   int x0 = static_cast<int>(floor(x));
   int y0 = static_cast<int>(floor(y));
-  int x1 = x0 + 1;
-  int y1 = y0 + 1;
 
   // Get the fractional part of the coordinates for bilinear interpolation
   double tx = x - x0;
   double ty = y - y0;
 
-  // Get the color of the four surrounding pixels
-  glm::dvec3 color00 = getPixelAt(x0, y0);
-  glm::dvec3 color10 = getPixelAt(x1, y0);
-  glm::dvec3 color01 = getPixelAt(x0, y1);
-  glm::dvec3 color11 = getPixelAt(x1, y1);
+  // Fetch them straight from the tiles, clamped to the edge of the image as getPixelAt() would
+  int left = std::clamp(x0, 0, width - 1), right = std::clamp(x0 + 1, 0, width - 1);
+  int bottom = std::clamp(y0, 0, height - 1), top = std::clamp(y0 + 1, 0, height - 1);
+  const uint8_t *color00 = texelAt(left, bottom);
+  const uint8_t *color10 = texelAt(right, bottom);
+  const uint8_t *color01 = texelAt(left, top);
+  const uint8_t *color11 = texelAt(right, top);
 
   // Bilinear interpolation using the surrounding pixel values
-  glm::dvec3 topBlend = color00 * (1.0 - tx) + color10 * tx;
-  glm::dvec3 bottomBlend = color01 * (1.0 - tx) + color11 * tx;
-  glm::dvec3 interpolatedColor = topBlend * (1.0 - ty) + bottomBlend * ty;
+  glm::dvec3 interpolatedColor;
+  for (int c = 0; c < 3; c++) {
+    double topBlend = UNIT[color00[c]] * (1.0 - tx) + UNIT[color10[c]] * tx;
+    double bottomBlend = UNIT[color01[c]] * (1.0 - tx) + UNIT[color11[c]] * tx;
+    interpolatedColor[c] = topBlend * (1.0 - ty) + bottomBlend * ty;
+  }
 
   return interpolatedColor;
 }
 
 glm::dvec3 TextureMap::getPixelAt(int x, int y) const {
 
-  if (width <= 0 || height <= 0 || data.empty())
+  if (width <= 0 || height <= 0 || tiles.empty())
   	return glm::dvec3(1.0, 1.0, 1.0);
 
   // Make sure the coordinates are within the bounds of the image, if not clamp them to the edge
-  if (x < 0)
-    x = 0;
-  else if (x >= width)
-	  x = width - 1;
-
-  if (y < 0)
-    y = 0;
-  else if (y >= height)
-    y = height - 1;
-
-  // Get the index of the pixel in the data array
-  int index = (x + y * width) * 3;
+  x = std::clamp(x, 0, width - 1);
+  y = std::clamp(y, 0, height - 1);
 
   // Convert the pixel values from [0, 255] to [0.0, 1.0]
-  double r = double(data[index]) / 255.0;
-  double g = double(data[index + 1]) / 255.0;
-  double b = double(data[index + 2]) / 255.0;
-  return glm::dvec3(r, g, b);
+  const uint8_t *texel = texelAt(x, y);
+  return glm::dvec3(UNIT[texel[0]], UNIT[texel[1]], UNIT[texel[2]]);
 }
 
 glm::dvec3 MaterialParameter::value(const isect &is) const {
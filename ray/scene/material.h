@@ -17,6 +17,7 @@
 class Scene;
 class ray;
 class isect;
+class Light;
 
 using std::string;
 
@@ -35,8 +36,8 @@ public:
   glm::dvec3 getMappedValue(const glm::dvec2 &coord) const;
 
   // Retrieve the value stored in a physical location (with integer coordinates)
-  // in the bitmap. Should be called from getMappedValue in order to do
-  // bilinear interpolation.
+  // in the bitmap, clamped to its edges. getMappedValue reads the tiles
+  // directly, the same way.
   glm::dvec3 getPixelAt(int x, int y) const;
 
   int getWidth() const { return width; }
@@ -45,9 +46,23 @@ public:
   ~TextureMap() {}
 
 protected:
+  // The texels are kept in 4x4 tiles of RGBA bytes, each tile exactly one
+  // 64-byte cache line, so the four texels of a lookup (and of the lookups
+  // next to it) are usually in the same line.
+  static const int TILE = 4;
+  struct alignas(64) Tile {
+    uint8_t texel[TILE * TILE][4];
+  };
+  const uint8_t *texelAt(int x, int y) const {
+    unsigned ux = x, uy = y;
+    return tiles[(uy / TILE) * tilesAcross + ux / TILE]
+        .texel[(uy % TILE) * TILE + ux % TILE];
+  }
+
   int width;
   int height;
-  std::vector<uint8_t> data;
+  int tilesAcross = 0;
+  std::vector<Tile> tiles;
 };
 
 class TextureMapException {
@@ -59,6 +74,23 @@ private:
   string _errorMsg;
 };
 
+/*
+One light's unshadowed Phong term at a shading point. Material::shade() scales
+each of these by the light's shadow attenuation right away; the wavefront
+engine collects them and resolves the shadow rays in bulk first.
+*/
+struct LightSample {
+  const Light *light;
+  glm::dvec3 origin;       // start of the shadow ray, nudged off the surface
+  glm::dvec3 direction;    // towards the light
+  glm::dvec3 contribution; // (diffuse + specular) * distance attenuation
+  bool facing;             // false if the light is behind the surface
+  bool castShadow;         // is contribution big enough to need a shadow ray?
+};
+
+// Most lights Material::sampleLights() will pick at one hit
+const int MAX_LIGHT_SAMPLES = 64;
+
 /*
 MaterialParameter is a helper class for a material; it stores either a constant
 value (in a 3-vector) or else a link to a map of some type. If the pointer to
@@ -159,6 +191,24 @@ public:
 
   virtual glm::dvec3 shade(Scene *scene, const ray &r, const isect &i) const;
 
+  // shade() specialized at compile time: Debug keeps the debugMode output,
+  // Shadows casts the shadow rays. Instantiated for all four combinations.
+  template <bool Debug, bool Shadows>
+  glm::dvec3 shadeKernel(Scene *scene, const ray &r, const isect &i) const;
+
+  // The pieces shade() is built from. shadeBase() is the emissive and ambient
+  // part; lightTerm() fills in one light's contribution before shadowing.
+  glm::dvec3 shadeBase(const Scene *scene, const isect &i) const;
+  void lightTerm(const Light *light, const ray &r, const isect &i,
+                 LightSample &s) const;
+
+  // The terms for the lights picked from the scene's LightTree at this hit,
+  // into out (room for MAX_LIGHT_SAMPLES); returns how many. Each is scaled
+  // by one over its chance of being picked, so together they stand in for
+  // every light in the tree. Shade these after the tree's others().
+  int sampleLights(const Scene *scene, const ray &r, const isect &i,
+                   LightSample *out) const;
+
   Material &operator+=(const Material &m) {
     _ke += m._ke;
     _ka += m._ka;
@@ -0,0 +1,83 @@
+//
+// morton.h
+//
+// Morton (Z-order) codes: interleave the bits of 2 or 3 integer coordinates
+// so that points close together in space tend to be close in the code.
+// Also the 2D Hilbert curve, which does the same without the long jumps.
+//
+
+#ifndef __MORTON_H__
+#define __MORTON_H__
+
+#include <stdint.h>
+
+// Spread the low 10 bits of v out so there are two zero bits between each.
+inline uint32_t mortonExpand3(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Spread the low 16 bits of v out so there is a zero bit between each.
+inline uint32_t mortonExpand2(uint32_t v) {
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// Spread the low 21 bits of v out so there are two zero bits between each.
+inline uint64_t mortonExpand3_64(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x001f00000000ffffull;
+  v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+// 30-bit code for a point on a 1024^3 grid.
+inline uint32_t morton3D(uint32_t x, uint32_t y, uint32_t z) {
+  return (mortonExpand3(x) << 2) | (mortonExpand3(y) << 1) | mortonExpand3(z);
+}
+
+// 63-bit code for a point on a 2097152^3 grid.
+inline uint64_t morton3D_64(uint64_t x, uint64_t y, uint64_t z) {
+  return (mortonExpand3_64(x) << 2) | (mortonExpand3_64(y) << 1) |
+         mortonExpand3_64(z);
+}
+
+// 32-bit code for a point on a 65536^2 grid.
+inline uint32_t morton2D(uint32_t x, uint32_t y) {
+  return (mortonExpand2(y) << 1) | mortonExpand2(x);
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n x n grid, where n
+// is a power of two.
+inline uint32_t hilbert2D(uint32_t n, uint32_t x, uint32_t y) {
+  uint32_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the sub-curve is in standard position
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      uint32_t t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return d;
+}
+
+#endif // __MORTON_H__
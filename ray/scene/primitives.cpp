@@ -0,0 +1,432 @@
+#include "primitives.h"
+
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+#include <cmath>
+#include <glm/glm.hpp>
+
+namespace {
+
+const MatrixTransform WORLD_SPACE;
+
+// The local space of primitive n, from the transforms parallel to prims.
+// Mesh faces all share the identity.
+template <class T>
+const MatrixTransform &localSpace(const MatrixTransform *xforms, size_t n) {
+  return xforms[n];
+}
+
+template <>
+const MatrixTransform &localSpace<TrimeshFace>(const MatrixTransform *,
+                                               size_t) {
+  return WORLD_SPACE;
+}
+
+// intersectLocal() of the concrete type, called without the vtable.
+template <class T> bool hitLocal(const Primitive &p, ray &r, isect &i) {
+  return static_cast<const T *>(p.object)->T::intersectLocal(r, i);
+}
+
+template <>
+bool hitLocal<TrimeshFace>(const Primitive &p, ray &r, isect &i) {
+  return p.face->intersectLocal(r, i);
+}
+
+template <class T>
+void hitPacketLocal(const Primitive &p, const RayPacket &P, isect *i,
+                    unsigned char *hit) {
+  ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), P.type);
+  for (int k = 0; k < P.size; k++) {
+    hit[k] = 0;
+    if (!P.active[k])
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    hit[k] = hitLocal<T>(p, r, i[k]);
+  }
+}
+
+template <>
+void hitPacketLocal<Trimesh>(const Primitive &p, const RayPacket &P, isect *i,
+                             unsigned char *hit) {
+  static_cast<const Trimesh *>(p.object)->Trimesh::intersectPacketLocal(P, i,
+                                                                       hit);
+}
+
+// Geometry::intersect() over one typed range: the same bounding box test and
+// change of coordinates, with the local test bound at compile time.
+template <class T>
+void closest(const Primitive *prims, const MatrixTransform *xforms,
+             size_t begin, size_t end, ray &r, PrimHit &best) {
+  glm::dvec3 Wpos = r.getPosition();
+  glm::dvec3 Wdir = r.getDirection();
+  for (size_t n = begin; n < end; n++) {
+    const Primitive &p = prims[n];
+    double tmin, tmax;
+    if (p.bounded && !p.bounds.intersect(r, tmin, tmax))
+      continue;
+    const MatrixTransform &xf = localSpace<T>(xforms, n);
+    glm::dvec3 pos, dir;
+    double length;
+    xf.rayToLocal(Wpos, Wdir, pos, dir, length);
+    r.setPosition(pos);
+    r.setDirection(dir);
+    isect cur;
+    bool hit = hitLocal<T>(p, r, cur);
+    r.setPosition(Wpos);
+    r.setDirection(Wdir);
+    if (!hit)
+      continue;
+    cur.setN(xf.normalToGlobal(cur.getN()));
+    cur.setT(cur.getT() / length);
+    if (best.closer(cur.getT(), p.order)) {
+      best.i = cur;
+      best.order = p.order;
+      best.prim = &p;
+    }
+  }
+}
+
+template <class T>
+void closest(const Primitive *prims, const MatrixTransform *xforms,
+             size_t begin, size_t end, const RayPacket &P, PrimHit *best) {
+  RayPacket local(P.size, P.type);
+  for (size_t n = begin; n < end; n++) {
+    const Primitive &p = prims[n];
+    unsigned char live[MAX_PACKET];
+    for (int k = 0; k < P.size; k++)
+      live[k] = P.active[k];
+    if (p.bounded && !p.bounds.intersect(P, live))
+      continue;
+
+    const MatrixTransform &xf = localSpace<T>(xforms, n);
+    double length[MAX_PACKET];
+    for (int k = 0; k < P.size; k++) {
+      local.active[k] = 0;
+      if (!live[k])
+        continue;
+      glm::dvec3 pos, dir;
+      xf.rayToLocal(P.getPosition(k), P.getDirection(k), pos, dir, length[k]);
+      local.set(k, pos, dir);
+    }
+
+    isect cur[MAX_PACKET];
+    unsigned char got[MAX_PACKET];
+    hitPacketLocal<T>(p, local, cur, got);
+    for (int k = 0; k < P.size; k++) {
+      if (!got[k])
+        continue;
+      cur[k].setN(xf.normalToGlobal(cur[k].getN()));
+      cur[k].setT(cur[k].getT() / length[k]);
+      if (best[k].closer(cur[k].getT(), p.order)) {
+        best[k].i = cur[k];
+        best[k].order = p.order;
+        best[k].prim = &p;
+      }
+    }
+  }
+}
+
+// Types we know nothing about keep their virtual intersect().
+template <>
+void closest<Geometry>(const Primitive *prims, const MatrixTransform *,
+                       size_t begin, size_t end, ray &r, PrimHit &best) {
+  for (size_t n = begin; n < end; n++) {
+    isect cur;
+    if (prims[n].object->intersect(r, cur) &&
+        best.closer(cur.getT(), prims[n].order)) {
+      best.i = cur;
+      best.order = prims[n].order;
+      best.prim = &prims[n];
+    }
+  }
+}
+
+template <>
+void closest<Geometry>(const Primitive *prims, const MatrixTransform *,
+                       size_t begin, size_t end, const RayPacket &P,
+                       PrimHit *best) {
+  for (size_t n = begin; n < end; n++) {
+    isect cur[MAX_PACKET];
+    unsigned char got[MAX_PACKET];
+    prims[n].object->intersect(P, cur, got);
+    for (int k = 0; k < P.size; k++) {
+      if (got[k] && best[k].closer(cur[k].getT(), prims[n].order)) {
+        best[k].i = cur[k];
+        best[k].order = prims[n].order;
+        best[k].prim = &prims[n];
+      }
+    }
+  }
+}
+
+template <class Ray, class Hit>
+void dispatch(const Primitive *prims, const MatrixTransform *xforms,
+              PrimType t, size_t begin, size_t end, Ray &r, Hit best) {
+  switch (t) {
+  case PRIM_SPHERE:
+    closest<Sphere>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_BOX:
+    closest<Box>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_SQUARE:
+    closest<Square>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_CYLINDER:
+    closest<Cylinder>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_CONE:
+    closest<Cone>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_MESH:
+    closest<Trimesh>(prims, xforms, begin, end, r, best);
+    break;
+  case PRIM_TRIANGLE:
+    closest<TrimeshFace>(prims, xforms, begin, end, r, best);
+    break;
+  default:
+    closest<Geometry>(prims, xforms, begin, end, r, best);
+    break;
+  }
+}
+
+} // anonymous namespace
+
+void PrimLanes::set(size_t n, const Primitive &p, const MatrixTransform &xform,
+                    bool sphere) {
+  // Keep a whole batch of room past n, so a batch starting anywhere up to n
+  // can be read without bounds checks.
+  size_t want = (n / PRIM_BATCH + 2) * PRIM_BATCH;
+  if (lo[0].size() < want) {
+    for (int a = 0; a < 3; a++) {
+      lo[a].resize(want, 0.0);
+      hi[a].resize(want, 0.0);
+    }
+    if (sphere)
+      for (int c = 0; c < 12; c++)
+        inv[c].resize(want, 0.0);
+  }
+
+  glm::dvec3 bmin = p.bounds.getMin(), bmax = p.bounds.getMax();
+  for (int a = 0; a < 3; a++) {
+    lo[a][n] = p.bounded ? bmin[a] : -1.0e308;
+    hi[a][n] = p.bounded ? bmax[a] : 1.0e308;
+  }
+  if (sphere) {
+    glm::dmat4x4 m = glm::inverse(xform.transform());
+    for (int c = 0; c < 4; c++)
+      for (int row = 0; row < 3; row++)
+        inv[c * 3 + row][n] = m[c][row];
+  }
+}
+
+unsigned PrimLanes::screen(size_t begin, const double *o,
+                           const double *d) const {
+  // BoundingBox::intersect() across the batch, without the early exits.
+  double tMin[PRIM_BATCH], tMax[PRIM_BATCH];
+  for (int l = 0; l < PRIM_BATCH; l++) {
+    tMin[l] = -1.0e308;
+    tMax[l] = 1.0e308;
+  }
+  for (int a = 0; a < 3; a++) {
+    double vd = d[a];
+    if (vd == 0.0)
+      continue;
+    const double *bl = &lo[a][begin];
+    const double *bh = &hi[a][begin];
+    for (int l = 0; l < PRIM_BATCH; l++) {
+      double t1 = (bl[l] - o[a]) / vd;
+      double t2 = (bh[l] - o[a]) / vd;
+      double tnear = t1 > t2 ? t2 : t1;
+      double tfar = t1 > t2 ? t1 : t2;
+      tMin[l] = tnear > tMin[l] ? tnear : tMin[l];
+      tMax[l] = tfar < tMax[l] ? tfar : tMax[l];
+    }
+  }
+  unsigned mask = 0;
+  for (int l = 0; l < PRIM_BATCH; l++)
+    mask |= unsigned((tMin[l] <= tMax[l]) & (tMax[l] >= RAY_EPSILON)) << l;
+  return mask;
+}
+
+unsigned PrimLanes::screenSpheres(size_t begin, const double *o,
+                                  const double *d) const {
+  // Take the ray into each sphere's local space and check the discriminant
+  // of |o + t d|^2 = 1. The direction is left unnormalized, and the cut-off
+  // is loose enough that rounding can't turn away a grazing hit.
+  const double *m[12];
+  for (int c = 0; c < 12; c++)
+    m[c] = &inv[c][begin];
+  unsigned mask = 0;
+  for (int l = 0; l < PRIM_BATCH; l++) {
+    double px = m[0][l] * o[0] + m[3][l] * o[1] + m[6][l] * o[2] + m[9][l];
+    double py = m[1][l] * o[0] + m[4][l] * o[1] + m[7][l] * o[2] + m[10][l];
+    double pz = m[2][l] * o[0] + m[5][l] * o[1] + m[8][l] * o[2] + m[11][l];
+    double qx = m[0][l] * d[0] + m[3][l] * d[1] + m[6][l] * d[2];
+    double qy = m[1][l] * d[0] + m[4][l] * d[1] + m[7][l] * d[2];
+    double qz = m[2][l] * d[0] + m[5][l] * d[1] + m[8][l] * d[2];
+    double a = qx * qx + qy * qy + qz * qz;
+    double b = px * qx + py * qy + pz * qz;
+    double c = px * px + py * py + pz * pz - 1.0;
+    double disc = b * b - a * c;
+    mask |= unsigned(disc >= -1.0e-6 * (b * b + fabs(a * c))) << l;
+  }
+  return mask;
+}
+
+void PrimitiveSet::add(const Geometry *obj, bool splitMeshes) {
+  PrimType t = PRIM_OTHER;
+  if (dynamic_cast<const Sphere *>(obj))
+    t = PRIM_SPHERE;
+  else if (dynamic_cast<const Box *>(obj))
+    t = PRIM_BOX;
+  else if (dynamic_cast<const Square *>(obj))
+    t = PRIM_SQUARE;
+  else if (dynamic_cast<const Cylinder *>(obj))
+    t = PRIM_CYLINDER;
+  else if (dynamic_cast<const Cone *>(obj))
+    t = PRIM_CONE;
+  else if (dynamic_cast<const Trimesh *>(obj))
+    t = PRIM_MESH;
+
+  const MatrixTransform &xf = obj->getTransform();
+  Primitive p;
+  p.bounds = obj->getBoundingBox();
+  p.bounded = obj->hasBoundingBoxCapability();
+  p.object = obj;
+  p.face = nullptr;
+
+  if (t == PRIM_MESH && splitMeshes &&
+      xf.getKind() == MatrixTransform::IDENTITY) {
+    // The faces are already in world space. Orders follow the face list, so
+    // ties between faces go the way Trimesh::intersectLocal() sends them.
+    for (const TrimeshFace *face :
+         static_cast<const Trimesh *>(obj)->getFaces()) {
+      p.bounds = face->getBoundingBox();
+      p.face = face;
+      p.order = nextOrder++;
+      lanes[PRIM_TRIANGLE].set(prims[PRIM_TRIANGLE].size(), p, WORLD_SPACE,
+                               false);
+      prims[PRIM_TRIANGLE].push_back(p);
+    }
+    return;
+  }
+
+  p.order = nextOrder++;
+  lanes[t].set(prims[t].size(), p, xf, t == PRIM_SPHERE);
+  prims[t].push_back(p);
+  transforms[t].push_back(xf);
+}
+
+std::vector<PrimRef> PrimitiveSet::refs() const {
+  std::vector<PrimRef> out;
+  out.reserve(size());
+  for (int t = 0; t < PRIM_TYPES; t++)
+    for (size_t n = 0; n < prims[t].size(); n++)
+      out.push_back({PrimType(t), (int)n});
+  return out;
+}
+
+void PrimitiveSet::regroup(const std::vector<PrimRef> &refs,
+                           const std::vector<int> &groupStart,
+                           std::vector<PrimRange> &ranges,
+                           std::vector<int> &rangeStart) {
+  std::vector<Primitive> out[PRIM_TYPES];
+  std::vector<MatrixTransform> outXforms[PRIM_TYPES];
+  ranges.clear();
+  rangeStart.assign(1, 0);
+  for (size_t g = 0; g + 1 < groupStart.size(); g++) {
+    for (int t = 0; t < PRIM_TYPES; t++) {
+      int begin = (int)out[t].size();
+      for (int n = groupStart[g]; n < groupStart[g + 1]; n++)
+        if (refs[n].type == t) {
+          out[t].push_back(prims[t][refs[n].index]);
+          if (t != PRIM_TRIANGLE)
+            outXforms[t].push_back(transforms[t][refs[n].index]);
+        }
+      if ((int)out[t].size() > begin)
+        ranges.push_back({PrimType(t), begin, (int)out[t].size()});
+    }
+    rangeStart.push_back((int)ranges.size());
+  }
+
+  for (int t = 0; t < PRIM_TYPES; t++) {
+    prims[t].swap(out[t]);
+    transforms[t].swap(outXforms[t]);
+    lanes[t] = PrimLanes();
+    for (size_t n = 0; n < prims[t].size(); n++)
+      lanes[t].set(n, prims[t][n],
+                   t == PRIM_TRIANGLE ? WORLD_SPACE : transforms[t][n],
+                   t == PRIM_SPHERE);
+  }
+}
+
+size_t PrimitiveSet::size() const {
+  size_t n = 0;
+  for (int t = 0; t < PRIM_TYPES; t++)
+    n += prims[t].size();
+  return n;
+}
+
+void PrimitiveSet::intersect(PrimType t, size_t begin, size_t end, ray &r,
+                             PrimHit &best) const {
+  if (t == PRIM_OTHER) {
+    dispatch<ray, PrimHit &>(prims[t].data(), transforms[t].data(), t, begin,
+                             end, r, best);
+    return;
+  }
+
+  // Screen a batch at a time, then run the full test on whatever is left.
+  glm::dvec3 pos = r.getPosition(), dir = r.getDirection();
+  double o[3] = {pos[0], pos[1], pos[2]};
+  double d[3] = {dir[0], dir[1], dir[2]};
+  for (size_t b = begin; b < end && !best.done(); b += PRIM_BATCH) {
+    unsigned mask = lanes[t].screen(b, o, d);
+    if (end - b < (size_t)PRIM_BATCH)
+      mask &= (1u << (end - b)) - 1;
+    if (mask && t == PRIM_SPHERE)
+      mask &= lanes[t].screenSpheres(b, o, d);
+    for (size_t n = b; mask; n++, mask >>= 1)
+      if (mask & 1)
+        dispatch<ray, PrimHit &>(prims[t].data(), transforms[t].data(), t, n,
+                                 n + 1, r, best);
+  }
+}
+
+void PrimitiveSet::intersect(PrimType t, size_t begin, size_t end,
+                             const RayPacket &P, PrimHit *best) const {
+  dispatch<const RayPacket, PrimHit *>(prims[t].data(), transforms[t].data(),
+                                       t, begin, end, P, best);
+}
+
+void PrimitiveSet::intersect(const PrimCopy &c, ray &r, PrimHit &best) {
+  dispatch<ray, PrimHit &>(&c.prim, &c.transform, c.type, 0, 1, r, best);
+}
+
+PrimCopy PrimitiveSet::copy(const Primitive *p) const {
+  PrimCopy c;
+  for (int t = 0; t < PRIM_TYPES; t++)
+    if (p >= prims[t].data() && p < prims[t].data() + prims[t].size()) {
+      c.type = PrimType(t);
+      c.prim = *p;
+      if (t != PRIM_TRIANGLE)
+        c.transform = transforms[t][p - prims[t].data()];
+    }
+  return c;
+}
+
+void PrimitiveSet::intersect(ray &r, PrimHit &best) const {
+  for (int t = 0; t < PRIM_TYPES; t++)
+    intersect(PrimType(t), 0, prims[t].size(), r, best);
+}
+
+void PrimitiveSet::intersect(const RayPacket &P, PrimHit *best) const {
+  for (int t = 0; t < PRIM_TYPES; t++)
+    intersect(PrimType(t), 0, prims[t].size(), P, best);
+}
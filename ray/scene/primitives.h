@@ -0,0 +1,165 @@
+//
+// primitives.h
+//
+// The scene's objects regrouped by concrete type, so the intersection loops
+// can walk one contiguous array per type and call that type's
+// intersectLocal() directly instead of going through the vtable.
+//
+
+#ifndef __PRIMITIVES_H__
+#define __PRIMITIVES_H__
+
+#include "bbox.h"
+#include "ray.h"
+#include "raypacket.h"
+#include "scene.h"
+
+#include <vector>
+
+class TrimeshFace;
+
+enum PrimType {
+  PRIM_SPHERE,
+  PRIM_BOX,
+  PRIM_SQUARE,
+  PRIM_CYLINDER,
+  PRIM_CONE,
+  PRIM_MESH,
+  PRIM_TRIANGLE, // one face of a mesh whose transform is the identity
+  PRIM_OTHER,    // anything else; tested through Geometry::intersect()
+  PRIM_TYPES
+};
+
+// What the inner loop needs to know about one object, copied out of it when
+// it is added to the scene. The object itself is only touched once the ray
+// has made it past the bounding box. Its transform is copied too, into an
+// array alongside (see PrimitiveSet::transforms).
+struct Primitive {
+  BoundingBox bounds;
+  bool bounded; // false: test every ray, as for Geometry
+  const Geometry *object;
+  const TrimeshFace *face; // PRIM_TRIANGLE only
+  int order; // position in the order added, to break ties the same way
+};
+
+// One primitive, named by its type and its index in that type's array.
+struct PrimRef {
+  PrimType type;
+  int index;
+};
+
+// A run of primitives of one type: [begin, end) of that type's array.
+struct PrimRange {
+  PrimType type;
+  int begin, end;
+};
+
+// The closest hit found so far. order is -1 until something has been hit.
+// Only hits strictly between tMin and tMax count. With any set, the first
+// one that does is enough and the searches stop there.
+struct PrimHit {
+  isect i;
+  int order = -1;
+  const Primitive *prim = nullptr; // what was hit; valid until the set changes
+  double tMin = -1.0e308, tMax = 1.0e308;
+  bool any = false;
+
+  // Would a hit at t on the primitive with order o replace this one? Ties
+  // go to the object added to the scene first, as with a plain loop over
+  // Scene::objects.
+  bool closer(double t, int o) const {
+    if (!(t > tMin && t < tMax))
+      return false;
+    return order < 0 || t < i.getT() || (t == i.getT() && o < order);
+  }
+  bool done() const { return any && order >= 0; }
+};
+
+// A primitive kept outside the set, e.g. the last one to block a shadow ray.
+// It stays usable after the set is rebuilt.
+struct PrimCopy {
+  PrimType type = PRIM_TYPES; // PRIM_TYPES: empty
+  Primitive prim;
+  MatrixTransform transform;
+};
+
+// The primitive that last blocked a shadow ray toward one light, tried
+// first for the next one (see Scene::occluded()), and how often that paid
+// off. Kept per thread, so a line each.
+struct alignas(64) OccluderCache {
+  PrimCopy last;
+  size_t queries = 0, blocked = 0, hits = 0;
+  size_t uncast = 0; // shadow rays not needed at all (see Material::shade())
+};
+
+// Primitives are screened against a ray this many at a time.
+const int PRIM_BATCH = 8;
+
+// The bounds (and for spheres, the inverse transform) of one type's
+// primitives in structure-of-arrays form, so a batch of them can be tested
+// against a ray in one pass the compiler can vectorize. The arrays run a
+// batch past the last primitive; padding entries never hit.
+struct PrimLanes {
+  std::vector<double> lo[3], hi[3];
+  std::vector<double> inv[12]; // columns of the world-to-local affine map
+
+  void set(size_t n, const Primitive &p, const MatrixTransform &xform,
+           bool sphere);
+
+  // Bit l is set if primitive begin + l might be hit by a ray at o along d.
+  // Never clears the bit of a primitive the exact test would hit.
+  unsigned screen(size_t begin, const double *o, const double *d) const;
+  unsigned screenSpheres(size_t begin, const double *o, const double *d) const;
+};
+
+class PrimitiveSet {
+public:
+  // Objects have to be added in scene order. With splitMeshes, a mesh whose
+  // transform is the identity goes in as one PRIM_TRIANGLE per face.
+  void add(const Geometry *obj, bool splitMeshes = false);
+
+  const std::vector<Primitive> &ofType(PrimType t) const { return prims[t]; }
+  const Primitive &operator[](const PrimRef &r) const {
+    return prims[r.type][r.index];
+  }
+  size_t size() const;
+
+  // Every primitive, in no particular order.
+  std::vector<PrimRef> refs() const;
+
+  // Rebuild the arrays in the order of groups, where group g is
+  // refs[groupStart[g]] up to refs[groupStart[g + 1]]. Each group's
+  // primitives of one type end up next to each other; group g's runs are
+  // ranges[rangeStart[g]] up to ranges[rangeStart[g + 1]]. A primitive may
+  // be listed more than once. Anything not listed is dropped.
+  void regroup(const std::vector<PrimRef> &refs,
+               const std::vector<int> &groupStart,
+               std::vector<PrimRange> &ranges, std::vector<int> &rangeStart);
+
+  // Fold the hits of primitives [begin, end) of type t into best. These are
+  // the building blocks for anything that stores typed index ranges.
+  void intersect(PrimType t, size_t begin, size_t end, ray &r,
+                 PrimHit &best) const;
+  void intersect(PrimType t, size_t begin, size_t end, const RayPacket &P,
+                 PrimHit *best) const;
+
+  // A copy of one of the set's primitives, such as PrimHit::prim.
+  PrimCopy copy(const Primitive *p) const;
+  // Fold the hit of a copied primitive into best.
+  static void intersect(const PrimCopy &c, ray &r, PrimHit &best);
+
+  // The same over every primitive in the set.
+  void intersect(ray &r, PrimHit &best) const;
+  void intersect(const RayPacket &P, PrimHit *best) const;
+
+private:
+  std::vector<Primitive> prims[PRIM_TYPES];
+  // Each primitive's local space, by value and parallel to prims, so the
+  // loops don't chase a pointer back into the object for it. Empty for
+  // PRIM_TRIANGLE, whose faces are already in world space.
+  std::vector<MatrixTransform> transforms[PRIM_TYPES];
+  PrimLanes lanes[PRIM_TYPES];
+  int nextOrder = 0;
+};
+
+#endif // __PRIMITIVES_H__
@@ -0,0 +1,71 @@
+//
+// raypacket.h
+//
+// A small bundle of rays that are traced together.
+//
+
+#ifndef __RAYPACKET_H__
+#define __RAYPACKET_H__
+
+#include "ray.h"
+#include <glm/vec3.hpp>
+
+// Largest number of rays in one packet (a 4x4 block of pixels).
+const int MAX_PACKET = 16;
+
+// Up to MAX_PACKET rays stored as separate coordinate arrays, so the loops
+// over the lanes of a packet can be turned into SIMD code by the compiler.
+// Lanes whose active flag is clear are skipped by every packet routine.
+class RayPacket {
+public:
+  RayPacket(int size = 0, ray::RayType type = ray::VISIBILITY)
+      : size(size), type(type) {
+    for (int k = 0; k < MAX_PACKET; k++) {
+      ox[k] = oy[k] = oz[k] = 0.0;
+      dx[k] = dy[k] = dz[k] = 0.0;
+      active[k] = 0;
+    }
+  }
+
+  void set(int k, const glm::dvec3 &p, const glm::dvec3 &d) {
+    ox[k] = p[0];
+    oy[k] = p[1];
+    oz[k] = p[2];
+    dx[k] = d[0];
+    dy[k] = d[1];
+    dz[k] = d[2];
+    active[k] = 1;
+  }
+
+  glm::dvec3 getPosition(int k) const {
+    return glm::dvec3(ox[k], oy[k], oz[k]);
+  }
+  glm::dvec3 getDirection(int k) const {
+    return glm::dvec3(dx[k], dy[k], dz[k]);
+  }
+
+  // Lane k as an ordinary ray, for the scalar fallbacks.
+  ray lane(int k) const {
+    return ray(getPosition(k), getDirection(k), glm::dvec3(1, 1, 1), type);
+  }
+
+  bool any() const {
+    for (int k = 0; k < size; k++)
+      if (active[k])
+        return true;
+    return false;
+  }
+
+  int size;
+  ray::RayType type;
+
+  alignas(64) double ox[MAX_PACKET];
+  alignas(64) double oy[MAX_PACKET];
+  alignas(64) double oz[MAX_PACKET];
+  alignas(64) double dx[MAX_PACKET];
+  alignas(64) double dy[MAX_PACKET];
+  alignas(64) double dz[MAX_PACKET];
+  unsigned char active[MAX_PACKET];
+};
+
+#endif // __RAYPACKET_H__
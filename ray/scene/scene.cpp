@@ -1,8 +1,12 @@
 #include <cmath>
 
 #include "../ui/TraceUI.h"
+#include "frustum.h"
 #include "kdTree.h"
 #include "light.h"
+#include "lighttree.h"
+#include "bvh.h"
+#include "primitives.h"
 #include "scene.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <glm/gtx/io.hpp>
@@ -15,11 +19,9 @@ bool Geometry::intersect(ray &r, isect &i) const {
   if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax)))
     return false;
   // Transform the ray into the object's local coordinate space
-  glm::dvec3 pos = transform.globalToLocalCoords(r.getPosition());
-  glm::dvec3 dir =
-      transform.globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-  double length = glm::length(dir);
-  dir = glm::normalize(dir);
+  glm::dvec3 pos, dir;
+  double length;
+  transform.rayToLocal(r.getPosition(), r.getDirection(), pos, dir, length);
   // Backup World pos/dir, and switch to local pos/dir
   glm::dvec3 Wpos = r.getPosition();
   glm::dvec3 Wdir = r.getDirection();
@@ -29,7 +31,7 @@ bool Geometry::intersect(ray &r, isect &i) const {
   if (intersectLocal(r, i)) {
     // Transform the intersection point & normal returned back into
     // global space.
-    i.setN(transform.localToGlobalCoordsNormal(i.getN()));
+    i.setN(transform.normalToGlobal(i.getN()));
     i.setT(i.getT() / length);
     rtrn = true;
   }
@@ -39,6 +41,49 @@ bool Geometry::intersect(ray &r, isect &i) const {
   return rtrn;
 }
 
+void Geometry::intersect(const RayPacket &P, isect *i,
+                         unsigned char *hit) const {
+  unsigned char live[MAX_PACKET];
+  for (int k = 0; k < P.size; k++) {
+    live[k] = P.active[k];
+    hit[k] = 0;
+  }
+  if (hasBoundingBoxCapability() && !bounds.intersect(P, live))
+    return;
+
+  // Same transformation as above, lane by lane
+  RayPacket local(P.size, P.type);
+  double length[MAX_PACKET];
+  for (int k = 0; k < P.size; k++) {
+    if (!live[k])
+      continue;
+    glm::dvec3 pos, dir;
+    transform.rayToLocal(P.getPosition(k), P.getDirection(k), pos, dir,
+                         length[k]);
+    local.set(k, pos, dir);
+  }
+  intersectPacketLocal(local, i, hit);
+  for (int k = 0; k < P.size; k++) {
+    if (hit[k]) {
+      i[k].setN(transform.normalToGlobal(i[k].getN()));
+      i[k].setT(i[k].getT() / length[k]);
+    }
+  }
+}
+
+void Geometry::intersectPacketLocal(const RayPacket &P, isect *i,
+                                    unsigned char *hit) const {
+  ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), P.type);
+  for (int k = 0; k < P.size; k++) {
+    hit[k] = 0;
+    if (!P.active[k])
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    hit[k] = intersectLocal(r, i[k]);
+  }
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
   // by default, primitives do not have to specify a bounding box. If this
   // method returns true for a primitive, then either the ComputeBoundingBox()
@@ -91,7 +136,9 @@ void Geometry::ComputeBoundingBox() {
   bounds.setMin(glm::dvec3(newMin));
 }
 
-Scene::Scene() { ambientIntensity = glm::dvec3(0, 0, 0); }
+Scene::Scene() : primitives(new PrimitiveSet) {
+  ambientIntensity = glm::dvec3(0, 0, 0);
+}
 
 Scene::~Scene() {
   for (auto &obj : objects)
@@ -104,35 +151,225 @@ void Scene::add(Geometry *obj) {
   obj->ComputeBoundingBox();
   sceneBounds.merge(obj->getBoundingBox());
   objects.emplace_back(obj);
+  primitives->add(obj);
+  bvh.reset();
 }
 
-void Scene::add(Light *light) { lights.emplace_back(light); }
+void Scene::add(Light *light) {
+  lights.emplace_back(light);
+  lightHierarchy.reset();
+}
 
+void Scene::bakeTransforms() {
+  bool changed = false;
+  for (auto &obj : objects)
+    changed |= obj->bakeTransform();
+  if (!changed)
+    return;
 
-// Get any intersection with an object.  Return information about the
-// intersection through the reference parameter.
-bool Scene::intersect(ray &r, isect &i) const {
-  double tmin = 0.0;
-  double tmax = 0.0;
-  bool have_one = false;
-  for (const auto &obj : objects) {
-    isect cur;
-    if (obj->intersect(r, cur)) {
-      if (!have_one || (cur.getT() < i.getT())) {
-        i = cur;
-        have_one = true;
+  // Bounds and the primitive arrays hold copies of the old transforms
+  sceneBounds = BoundingBox();
+  for (auto &obj : objects) {
+    obj->ComputeBoundingBox();
+    sceneBounds.merge(obj->getBoundingBox());
+  }
+  rebuildPrimitives(false);
+}
+
+void Scene::rebuildPrimitives(bool splitMeshes) {
+  bvh.reset();
+  primitives.reset(new PrimitiveSet);
+  for (auto &obj : objects)
+    primitives->add(obj, splitMeshes);
+}
+
+bool Scene::buildAccelerator(bool enabled, const BVHOptions &opt) {
+  if (!enabled) {
+    if (bvh)
+      rebuildPrimitives(false);
+    return false;
+  }
+  if (bvh && bvh->options() == BVH::clamped(opt))
+    return false;
+  // A tree regroups the arrays it is built over, so start from fresh ones
+  rebuildPrimitives(true);
+  bvh.reset(new BVH(*primitives, sceneBounds, opt));
+  return true;
+}
+
+void Scene::measureAccelerator(const BVHOptions &opt, BVHStats &stats,
+                               int grid) const {
+  PrimitiveSet prims;
+  for (auto &obj : objects)
+    prims.add(obj, true);
+  BVH tree(prims, sceneBounds, opt);
+  stats = tree.stats();
+
+  size_t steps[2] = {0, 0};
+  for (int y = 0; y < grid; y++)
+    for (int x = 0; x < grid; x++) {
+      ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
+            ray::VISIBILITY);
+      camera.rayThrough((x + 0.5) / grid, (y + 0.5) / grid, r);
+      PrimHit best;
+      tree.countSteps(prims, r, best, steps);
+    }
+  double rays = std::max(1, grid * grid);
+  stats.nodesPerRay = steps[0] / rays;
+  stats.primsPerRay = steps[1] / rays;
+}
+
+void Scene::buildLightTree() { lightHierarchy.reset(new LightTree(lights)); }
+
+void Scene::sampleLights(int samples) {
+  samplesPerHit = std::max(0, std::min(samples, MAX_LIGHT_SAMPLES));
+}
+
+const LightTree *Scene::lightTree() const {
+  if (samplesPerHit == 0 || !lightHierarchy || lightHierarchy->size() == 0)
+    return nullptr;
+  return lightHierarchy.get();
+}
+
+void Scene::closest(ray &r, PrimHit &best, const BVHCut *cut) const {
+  if (bvh)
+    bvh->intersect(*primitives, r, best, cut);
+  else
+    primitives->intersect(r, best);
+}
+
+namespace {
+// A search for anything blocking a shadow ray between RAY_EPSILON and tMax.
+// The cached occluder and the full search both go through it, so they agree
+// on what blocks a ray.
+PrimHit blocker(double tMax) {
+  PrimHit hit;
+  hit.tMin = RAY_EPSILON;
+  hit.tMax = tMax;
+  hit.any = true;
+  return hit;
+}
+} // anonymous namespace
+
+bool Scene::occluded(ray &r, double tMax, OccluderCache &cache) const {
+  bool cached = occluderCache && !recording;
+  if (cached) {
+    // Neighbouring shadow rays tend to be blocked by the same thing
+    cache.queries++;
+    if (cache.last.type != PRIM_TYPES) {
+      PrimHit hit = blocker(tMax);
+      PrimitiveSet::intersect(cache.last, r, hit);
+      if (hit.order >= 0) {
+        cache.hits++;
+        cache.blocked++;
+        return true;
       }
     }
   }
-  if (!have_one)
+
+  // The debugging view draws the nearest blocker, not just any
+  PrimHit best = blocker(tMax);
+  best.any = !recording;
+  closest(r, best);
+  if (recording) {
+    isect i = best.i;
+    if (best.order < 0)
+      i.setT(1000.0);
+    addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
+  }
+  if (best.order < 0)
+    return false;
+  if (cached) {
+    cache.last = primitives->copy(best.prim);
+    cache.blocked++;
+  }
+  return true;
+}
+
+void Scene::occluded(const RayPacket &P, double tMax, OccluderCache &cache,
+                     unsigned char *blocked) const {
+  bool cached = occluderCache && !recording;
+  RayPacket Q = P; // the lanes left for a full search
+  ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), ray::SHADOW);
+  for (int k = 0; k < P.size; k++) {
+    blocked[k] = 0;
+    if (!P.active[k] || !cached)
+      continue;
+    cache.queries++;
+    if (cache.last.type == PRIM_TYPES)
+      continue;
+    r.setPosition(P.getPosition(k));
+    r.setDirection(P.getDirection(k));
+    PrimHit hit = blocker(tMax);
+    PrimitiveSet::intersect(cache.last, r, hit);
+    if (hit.order >= 0) {
+      cache.hits++;
+      cache.blocked++;
+      blocked[k] = 1;
+      Q.active[k] = 0;
+    }
+  }
+  if (!Q.any())
+    return;
+
+  PrimHit best[MAX_PACKET];
+  for (int k = 0; k < P.size; k++)
+    best[k] = blocker(tMax);
+  if (bvh)
+    bvh->intersect(*primitives, Q, best);
+  else
+    primitives->intersect(Q, best);
+  for (int k = 0; k < P.size; k++) {
+    if (!Q.active[k] || best[k].order < 0)
+      continue;
+    blocked[k] = 1;
+    if (cached) {
+      cache.last = primitives->copy(best[k].prim);
+      cache.blocked++;
+    }
+  }
+}
+
+// Get any intersection with an object.  Return information about the
+// intersection through the reference parameter.
+bool Scene::intersect(ray &r, isect &i, const BVHCut *cut) const {
+  PrimHit best;
+  closest(r, best, cut);
+  bool have_one = best.order >= 0;
+  if (have_one)
+    i = best.i;
+  else
     i.setT(1000.0);
   // if debugging,
-  if (TraceUI::m_debug) {
+  if (recording) {
     addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
   }
   return have_one;
 }
 
+void Scene::intersect(const RayPacket &P, isect *i, unsigned char *hit,
+                      const BVHCut *cut) const {
+  PrimHit best[MAX_PACKET];
+  if (bvh)
+    bvh->intersect(*primitives, P, best, cut);
+  else
+    primitives->intersect(P, best);
+  for (int k = 0; k < P.size; k++) {
+    hit[k] = best[k].order >= 0;
+    if (hit[k])
+      i[k] = best[k].i;
+    else if (P.active[k])
+      i[k].setT(1000.0);
+  }
+}
+
+bool Scene::cull(const Frustum &frustum, BVHCut &cut) const {
+  if (!bvh)
+    return false;
+  bvh->cull(*primitives, frustum, cut);
+  return true;
+}
+
 TextureMap *Scene::getTexture(string name) {
   auto itr = textureCache.find(name);
   if (itr == textureCache.end()) {
@@ -20,6 +20,7 @@
 #include "camera.h"
 #include "material.h"
 #include "ray.h"
+#include "raypacket.h"
 
 #include <glm/geometric.hpp>
 #include <glm/mat3x3.hpp>
@@ -30,7 +31,16 @@
 
 using std::unique_ptr;
 
+class Frustum;
 class Light;
+class PrimitiveSet;
+struct PrimHit;
+class BVH;
+struct BVHCut;
+struct BVHOptions;
+struct BVHStats;
+struct OccluderCache;
+class LightTree;
 class Scene;
 
 template <typename Obj> class KdTree;
@@ -62,10 +72,21 @@ inline glm::dvec3 operator*(const glm::dmat4x4 &mat, const glm::dvec3 &vec) {
 }
 
 class MatrixTransform {
+public:
+  // What kind of matrix xform is, worked out once when it is built so rays
+  // can skip the full 4x4 product for the common cases.
+  enum Kind {
+    IDENTITY,      // nothing to do
+    TRANSLATE,     // an offset only
+    UNIFORM_SCALE, // the same scale on every axis, plus an offset
+    GENERAL
+  };
+
 protected:
   glm::dmat4x4 xform;
   glm::dmat4x4 inverse;
   glm::dmat3x3 normi;
+  Kind kind;
 
 public:
   MatrixTransform() : MatrixTransform(glm::dmat4(1.0)) {}
@@ -73,8 +94,11 @@ public:
   MatrixTransform(const glm::dmat4x4 &xform) : xform{xform} {
     this->inverse = glm::inverse(this->xform);
     this->normi = glm::transpose(glm::inverse(glm::dmat3x3(this->xform)));
+    classify();
   }
 
+  Kind getKind() const { return kind; }
+
   // Coordinate-Space transformation
   glm::dvec3 globalToLocalCoords(const glm::dvec3 &v) const {
     return inverse * v;
@@ -92,7 +116,76 @@ public:
     return glm::normalize(normi * v);
   }
 
+  // Take the ray at p along d into local space: pos and the unit direction
+  // dir, plus the length a unit of global t has there (local t divided by
+  // length is global t).
+  void rayToLocal(const glm::dvec3 &p, const glm::dvec3 &d, glm::dvec3 &pos,
+                  glm::dvec3 &dir, double &length) const {
+    switch (kind) {
+    case IDENTITY:
+      pos = p;
+      dir = d;
+      break;
+    case TRANSLATE:
+      pos = p + glm::dvec3(inverse[3]);
+      dir = d;
+      break;
+    case UNIFORM_SCALE:
+      pos = p * inverse[0][0] + glm::dvec3(inverse[3]);
+      dir = d * inverse[0][0];
+      break;
+    default:
+      pos = inverse * p;
+      dir = inverse * (p + d) - pos;
+      break;
+    }
+    length = glm::length(dir);
+    dir = glm::normalize(dir);
+  }
+
+  // localToGlobalCoordsNormal(), except that a normal only needs
+  // renormalizing (and flipping, for a negative scale) when the transform
+  // has no rotation or shear.
+  glm::dvec3 normalToGlobal(const glm::dvec3 &n) const {
+    switch (kind) {
+    case IDENTITY:
+    case TRANSLATE:
+      return glm::normalize(n);
+    case UNIFORM_SCALE:
+      return glm::normalize(n * normi[0][0]);
+    default:
+      return glm::normalize(normi * n);
+    }
+  }
+
   const glm::dmat4x4 &transform() const { return xform; }
+  const glm::dmat3x3 &normalMatrix() const { return normi; }
+
+private:
+  void classify() {
+    bool diagonal = true, unit = true;
+    for (int c = 0; c < 3; c++)
+      for (int r = 0; r < 4; r++) {
+        double want = (r == c) ? 1.0 : 0.0;
+        if (r != c && xform[c][r] != 0.0)
+          diagonal = false;
+        if (xform[c][r] != want)
+          unit = false;
+      }
+    bool uniform = diagonal && xform[0][0] == xform[1][1] &&
+                   xform[0][0] == xform[2][2] && xform[0][0] != 0.0 &&
+                   xform[3][3] == 1.0;
+    bool moved = xform[3][0] != 0.0 || xform[3][1] != 0.0 ||
+                 xform[3][2] != 0.0 || xform[3][3] != 1.0;
+    if (unit && !moved)
+      kind = IDENTITY;
+    else if (unit && xform[3][3] == 1.0)
+      kind = TRANSLATE;
+    else if (uniform)
+      kind = UNIFORM_SCALE;
+    else
+      kind = GENERAL;
+  }
 };
 
 // A Geometry object is anything that has extent in three dimensions.
@@ -104,16 +197,29 @@ protected:
   // do not call directly - this should only be called by intersect()
   virtual bool intersectLocal(ray &r, isect &i) const = 0;
 
+  // packet version of intersectLocal(); P is already in local coordinates.
+  // The default runs intersectLocal() on each active lane in turn.
+  virtual void intersectPacketLocal(const RayPacket &P, isect *i,
+                                    unsigned char *hit) const;
+
 public:
   // intersections performed in the global coordinate space.
   bool intersect(ray &r, isect &i) const;
 
+  // For every active lane k of P, does what intersect(P.lane(k), i[k])
+  // would and stores the result in hit[k].
+  void intersect(const RayPacket &P, isect *i, unsigned char *hit) const;
+
   virtual bool hasBoundingBoxCapability() const;
   const BoundingBox &getBoundingBox() const { return bounds; }
   glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
 
   virtual void ComputeBoundingBox();
 
+  // Move the transform into the object's own data, leaving it with the
+  // identity. Returns true if anything changed; the default can't do this.
+  virtual bool bakeTransform() { return false; }
+
   // default method for ComputeLocalBoundingBox returns a bogus bounding box;
   // this should be overridden if hasBoundingBoxCapability() is true.
   virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
@@ -121,6 +227,7 @@ public:
   void setTransform(const MatrixTransform &transform) {
     this->transform = transform;
   };
+  const MatrixTransform &getTransform() const { return transform; }
 
   Geometry(Scene *scene) : SceneElement(scene) {}
 
@@ -171,7 +278,59 @@ public:
   void add(Geometry *obj);
   void add(Light *light);
 
-  bool intersect(ray &r, isect &i) const;
+  // Give every object that supports it a world-space copy of its data and
+  // an identity transform (see Geometry::bakeTransform()).
+  void bakeTransforms();
+
+  // Build a BVH over the objects, splitting meshes into their faces, or with
+  // enabled false go back to testing every object. Nothing is rebuilt if the
+  // scene already has a tree built with the same options. True if a tree
+  // was built.
+  bool buildAccelerator(bool enabled, const BVHOptions &opt);
+
+  // Build a throwaway tree with opt and fill in its statistics, tracing a
+  // grid x grid set of camera rays through it for the per-ray averages.
+  void measureAccelerator(const BVHOptions &opt, BVHStats &stats,
+                          int grid) const;
+
+  // With a cut, only search that part of the BVH (see cull()).
+  bool intersect(ray &r, isect &i, const BVHCut *cut = nullptr) const;
+
+  // Is r blocked by anything between RAY_EPSILON and tMax? Hits at or
+  // before RAY_EPSILON are skipped, not taken as the nearest, and the search
+  // stops at the first hit in range. Tries the primitive in cache first, and
+  // remembers the blocker a full search finds.
+  bool occluded(ray &r, double tMax, OccluderCache &cache) const;
+  // The same for every active lane of a packet of shadow rays, setting
+  // blocked[k]. Lanes the cached primitive doesn't block are searched for
+  // together.
+  void occluded(const RayPacket &P, double tMax, OccluderCache &cache,
+                unsigned char *blocked) const;
+  void cacheOccluders(bool on) { occluderCache = on; }
+
+  // Lights whose unshadowed contribution is no more than this in every
+  // channel are added without a shadow ray (see Material::lightTerm()).
+  void cullShadows(double cutoff) { minShadowed = cutoff; }
+  double shadowCutoff() const { return minShadowed; }
+
+  // Group the point lights into a LightTree. With samples above zero,
+  // shading picks that many of them from the tree at each hit instead of
+  // visiting them all (see Material::sampleLights()); lightTree() is null
+  // when every light is shaded.
+  void buildLightTree();
+  void sampleLights(int samples);
+  int lightSamples() const { return samplesPerHit; }
+  const LightTree *lightTree() const;
+
+  // Closest hit for every active lane of a packet. Lanes that miss get
+  // hit[k] == 0 and a T of 1000, as with the single-ray version.
+  void intersect(const RayPacket &P, isect *i, unsigned char *hit,
+                 const BVHCut *cut = nullptr) const;
+
+  // The part of the BVH a ray inside the frustum could reach, for
+  // intersect() to search instead of the whole tree. False when there is
+  // no tree to cull.
+  bool cull(const Frustum &frustum, BVHCut &cut) const;
 
   auto beginLights() const { return lights.begin(); }
   auto endLights() const { return lights.end(); }
@@ -213,6 +372,13 @@ private:
   */
   std::vector<Geometry *> objects;
   std::vector<Light *> lights;
+
+  // objects again, sorted into one array per concrete type
+  std::unique_ptr<PrimitiveSet> primitives;
+  // and a hierarchy over them, if built; null means test them all
+  std::unique_ptr<BVH> bvh;
+  // and one over the point lights, if built
+  std::unique_ptr<LightTree> lightHierarchy;
   Camera camera;
 
   // This is the total amount of ambient light in the scene
@@ -222,6 +388,13 @@ private:
   typedef std::map<std::string, std::unique_ptr<TextureMap>> tmap;
   tmap textureCache;
 
+  void rebuildPrimitives(bool splitMeshes);
+  void closest(ray &r, PrimHit &best, const BVHCut *cut = nullptr) const;
+
+  bool occluderCache = true; // let occluded() use its cache?
+  double minShadowed = 0.0;  // see cullShadows()
+  int samplesPerHit = 0;     // see sampleLights()
+
   // Each object in the scene that has a hasBoundingBoxCapability(),
   // must fall within this bounding box. Objects that don't have
   // hasBoundingBoxCapability() are exempt from this requirement.
@@ -231,8 +404,12 @@ private:
 
   mutable std::mutex intersectionCacheMutex;
 
+  // Record every intersect() in intersectCache for the debugging view?
+  bool recording = false;
+
 public:
   // This is used for debugging purposes only.
+  void recordIntersections(bool on) { recording = on; }
   void addToIntersectCache(std::pair<ray *, isect *> isect) const {
     intersectionCacheMutex.lock();
     intersectCache.push_back(isect);
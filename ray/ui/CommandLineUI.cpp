@@ -2,22 +2,34 @@
 #include <stdarg.h>
 #include <time.h>
 #ifndef _MSC_VER
+#include <strings.h>
 #include <unistd.h>
 #else
+#define strcasecmp _stricmp
 extern char *optarg;
 extern int optind, opterr, optopt;
 extern int getopt(int argc, char **argv, const char *optstring);
 #endif
 
 #include <assert.h>
+#include <memory>
+#include <string.h>
 
 #include "../fileio/images.h"
+#include "../fileio/pngstream.h"
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
 
 using namespace std;
 
+namespace {
+bool isPNG(const char *fname) {
+  const char *ext = strrchr(fname, '.');
+  return ext && !strcasecmp(ext, ".png");
+}
+} // anonymous namespace
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
@@ -25,7 +37,8 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   progName = argv[0];
   const char *jsonfile = nullptr;
   string cubemap_file;
-  while ((i = getopt(argc, argv, "tr:w:hj:c:")) != EOF) {
+  int aa_budget = -1;
+  while ((i = getopt(argc, argv, "tr:w:hj:c:z:a:")) != EOF) {
     switch (i) {
     case 'r':
       m_nDepth = atoi(optarg);
@@ -39,6 +52,12 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
     case 'c':
       cubemap_file = optarg;
       break;
+    case 'z':
+      m_nPngLevel = atoi(optarg);
+      break;
+    case 'a':
+      aa_budget = atoi(optarg);
+      break;
     case 'h':
       usage();
       exit(1);
@@ -55,6 +74,12 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   if (!cubemap_file.empty()) {
     smartLoadCubemap(cubemap_file);
   }
+  // After the JSON file, so a budget given here wins over its settings
+  if (aa_budget >= 0) {
+    m_nAaBudget = aa_budget;
+    if (aa_budget > 0)
+      m_antiAlias = true;
+  }
 
   if (optind >= argc - 1) {
     std::cerr << "no input and/or output name." << std::endl;
@@ -75,6 +100,19 @@ int CommandLineUI::run() {
 
     raytracer->traceSetup(width, height);
 
+    // PNG output is encoded a band at a time while the frame is tracing.
+    std::unique_ptr<PNGStreamWriter> png;
+    if (isPNG(imgName)) {
+      png.reset(new PNGStreamWriter(imgName, width, height, m_nPngLevel,
+                                    m_threads));
+      raytracer->setRowsDoneCallback([this, &png](int y0, int y1) {
+        unsigned char *rows;
+        int w, h;
+        raytracer->getBuffer(rows, w, h);
+        png->addRows(y0, y1, rows);
+      });
+    }
+
     clock_t start, end;
     start = clock();
 
@@ -86,13 +124,18 @@ int CommandLineUI::run() {
     }
 
     end = clock();
+    if (renderStatsSw())
+      raytracer->reportStats(std::cerr);
 
     // save image
     unsigned char *buf;
 
     raytracer->getBuffer(buf, width, height);
 
-    if (buf)
+    if (png) {
+      raytracer->setRowsDoneCallback(nullptr);
+      png->finish();
+    } else if (buf)
       writeImage(imgName, width, height, buf);
 
     [[maybe_unused]] double t = (double)(end - start) / CLOCKS_PER_SEC;
@@ -118,5 +161,10 @@ void CommandLineUI::usage() {
        << "  -j <FILE>   set parameters from JSON file" << endl
        << "  -c <FILE>   one Cubemap file, the remainings will be "
           "detected automatically"
+       << endl
+       << "  -z <#>      zlib level for PNG output, 0-9 (default "
+       << m_nPngLevel << ")" << endl
+       << "  -a <#>      anti-alias with at most # new samples, spent where "
+          "the error is worst (0 = by aa_threshold)"
        << endl;
 }
@@ -45,6 +45,7 @@ int TraceGLWindow::handle(int event) {
         raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight);
 
       debugMode = true;
+      raytracer->setDebug(TraceUI::m_debug);
       raytracer->tracePixel(x, y);
 
       ((GraphicalUI *)traceUI)->m_debuggingWindow->m_debuggingView->redraw();
@@ -35,6 +35,41 @@ TraceUI::~TraceUI() {}
 
 void TraceUI::setCubeMap(CubeMap *cm) { cubemap.reset(cm); }
 
+RenderSettings TraceUI::renderSettings() const {
+  RenderSettings s;
+  s.depth = getDepth();
+  s.threads = getThreads();
+  s.blockSize = getBlockSize();
+  s.threshold = getThreshold();
+  s.interpolate = interpolateSw();
+  s.antiAlias = aaSwitch();
+  s.superSamples = getSuperSamples();
+  s.aaThreshold = getAaThreshold();
+  s.aaEdges = aaEdgesSw();
+  s.aaBudget = getAaBudget();
+  s.cubeMap = cubeMap() ? getCubeMap() : nullptr;
+  s.filterWidth = getFilterWidth();
+  s.shadows = shadowSw();
+  s.packetSize = getPacketSize();
+  s.tileSize = getTileSize();
+  s.pixelOrder = getPixelOrder();
+  s.frustumCull = frustumCullSw();
+  s.wavefront = wavefrontSw();
+  s.sortSecondary = sortSecondarySw();
+  s.accelerate = kdSwitch();
+  s.bvhBuilder = getBvhBuilder();
+  s.treeDepth = getMaxDepth();
+  s.leafSize = getLeafSize();
+  s.bvhTreelets = bvhTreeletsSw();
+  s.bvhSplitBudget = getSplitBudget();
+  s.bvhStats = bvhStatsSw();
+  s.shadowCache = shadowCacheSw();
+  s.shadowCutoff = getShadowCutoff();
+  s.lightSamples = getLightSamples();
+  s.debug = m_debug;
+  return s;
+}
+
 void TraceUI::loadFromJson(const char *file) {
   std::ifstream fin(file);
   Json json;
@@ -50,11 +85,30 @@ void TraceUI::loadFromJson(const char *file) {
   load(json, "tree_depth", m_nTreeDepth);
   load(json, "leaf_size", m_nLeafSize);
   load(json, "filter_width", m_nFilterWidth);
+  load(json, "png_level", m_nPngLevel);
+  load(json, "packet_size", m_nPacketSize);
+  load(json, "tile_size", m_nTileSize);
+  load(json, "pixel_order", m_nPixelOrder);
+  load(json, "bvh_builder", m_nBvhBuilder);
+  load(json, "bvh_split_budget", m_nSplitBudget);
   load(json, "anti_alias", m_antiAlias);
+  load(json, "aa_edges", m_aaEdges);
+  load(json, "aa_budget", m_nAaBudget);
+  load(json, "interpolate", m_interpolate);
   load(json, "kdtree", m_kdTree);
   load(json, "shadows", m_shadows);
   load(json, "smoothshade", m_smoothshade);
   load(json, "backface_culling", m_backface);
+  load(json, "wavefront", m_wavefront);
+  load(json, "sort_secondary", m_sortSecondary);
+  load(json, "frustum_cull", m_frustumCull);
+  load(json, "bake_meshes", m_bakeMeshes);
+  load(json, "bvh_treelets", m_bvhTreelets);
+  load(json, "bvh_stats", m_bvhStats);
+  load(json, "shadow_cache", m_shadowCache);
+  load(json, "shadow_cutoff", m_nShadowCutoff);
+  load(json, "light_samples", m_nLightSamples);
+  load(json, "render_stats", m_renderStats);
   /*
    * Note for Students:
    * The following options are legacy from previous semesters.
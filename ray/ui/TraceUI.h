@@ -7,6 +7,7 @@
 #ifndef __TraceUI_h__
 #define __TraceUI_h__
 
+#include "../RenderSettings.h"
 #include <memory>
 #include <string>
 #define MAX_THREADS 32
@@ -36,13 +37,32 @@ public:
   int getBlockSize() const { return m_nBlockSize; }
   double getThreshold() const { return (double)m_nThreshold * 0.001; }
   double getAaThreshold() const { return (double)m_nAaThreshold * 0.001; }
+  double getShadowCutoff() const { return (double)m_nShadowCutoff * 0.001; }
   int getSuperSamples() const { return m_nSuperSamples; }
   int getMaxDepth() const { return m_nTreeDepth; }
   int getLeafSize() const { return m_nLeafSize; }
   int getFilterWidth() const { return m_nFilterWidth; }
   int getThreads() const { return m_threads; }
+  int getPngLevel() const { return m_nPngLevel; }
+  int getPacketSize() const { return m_nPacketSize; }
+  int getTileSize() const { return m_nTileSize; }
+  int getPixelOrder() const { return m_nPixelOrder; }
+  int getBvhBuilder() const { return m_nBvhBuilder; }
+  int getLightSamples() const { return m_nLightSamples; }
+  int getAaBudget() const { return m_nAaBudget; }
+  double getSplitBudget() const { return (double)m_nSplitBudget * 0.01; }
   bool aaSwitch() const { return m_antiAlias; }
+  bool aaEdgesSw() const { return m_aaEdges; }
+  bool interpolateSw() const { return m_interpolate; }
   bool kdSwitch() const { return m_kdTree; }
+  bool wavefrontSw() const { return m_wavefront; }
+  bool sortSecondarySw() const { return m_sortSecondary; }
+  bool frustumCullSw() const { return m_frustumCull; }
+  bool bakeMeshesSw() const { return m_bakeMeshes; }
+  bool bvhTreeletsSw() const { return m_bvhTreelets; }
+  bool bvhStatsSw() const { return m_bvhStats; }
+  bool shadowCacheSw() const { return m_shadowCache; }
+  bool renderStatsSw() const { return m_renderStats; }
   bool shadowSw() const { return m_shadows; }
   bool smShadSw() const { return m_smoothshade; }
   bool bkFaceSw() const { return m_backface; }
@@ -52,6 +72,9 @@ public:
   bool internalReflection() const { return m_internalReflection; }
   bool backfaceSpecular() const { return m_backfaceSpecular; }
 
+  // Snapshot of the settings above for RayTracer::traceSetup()
+  RenderSettings renderSettings() const;
+
   // ray counter
   static void addRays(int number, int ctr) {
     if (ctr >= 0)
@@ -95,13 +118,23 @@ protected:
 
   int m_nSize = 512;        // Size of the traced image
   int m_nDepth = 0;         // Max depth of recursion
-  int m_nThreshold = 0;     // Threshold for interpolation within block
+  int m_nThreshold = 0;     // Least ray weight worth tracing, and colour
+                            // difference that splits a preview block, x1000
   int m_nBlockSize = 4;     // Blocksize (square, even, power of 2 preferred)
   int m_nSuperSamples = 3;  // Supersampling rate (1-d) for antialiasing
   int m_nAaThreshold = 100; // Pixel neighborhood difference for supersampling
-  int m_nTreeDepth = 15;    // maximum kdTree depth
-  int m_nLeafSize = 10;     // target number of objects per leaf
+  int m_nTreeDepth = 15;    // maximum BVH depth
+  int m_nLeafSize = 10;     // target number of primitives per leaf
   int m_nFilterWidth = 1;   // width of cubemap filter
+  int m_nPngLevel = 6;      // zlib level (0-9) for streamed PNG output
+  int m_nPacketSize = 1;    // camera rays per packet (1 = off, 4, 8, 16)
+  int m_nTileSize = 16;     // edge of a screen tile, in pixels
+  int m_nPixelOrder = 0;    // 0 scanline, 1 Morton, 2 Hilbert (PixelOrder)
+  int m_nBvhBuilder = 0;    // 0 SAH, 1 Morton-code LBVH, 2 SBVH (BVHBuilder)
+  int m_nSplitBudget = 30;  // SBVH duplicate references allowed, percent
+  int m_nShadowCutoff = 0;  // Light contribution needing a shadow ray, x1000
+  int m_nLightSamples = 0;  // point lights picked per hit from a tree, 0 = all
+  int m_nAaBudget = 0;      // AA rays per frame at most, worst first, 0 = off
 
   static int rayCount[MAX_THREADS]; // Ray counter
 
@@ -110,11 +143,21 @@ protected:
   // reasons.
   bool m_displayDebuggingInfo = false;
   bool m_antiAlias = false;    // Is antialiasing on?
-  bool m_kdTree = true;        // use kd-tree?
+  bool m_aaEdges = false;      // Only antialias edges found in the first pass?
+  bool m_interpolate = false;  // Interpolate smooth blocks instead of tracing?
+  bool m_kdTree = true;        // use an acceleration structure (BVH)?
   bool m_shadows = true;       // compute shadows?
   bool m_smoothshade = true;   // turn on/off smoothshading?
   bool m_backface = true;      // cull backfaces?
   bool m_usingCubeMap = false; // render with cubemap
+  bool m_wavefront = false;    // trace breadth-first (WavefrontTracer)?
+  bool m_sortSecondary = false; // sort wavefront secondary rays by origin?
+  bool m_frustumCull = false;  // cull BVH nodes against each tile's frustum?
+  bool m_bakeMeshes = true;    // move mesh vertices into world space on load?
+  bool m_bvhTreelets = false;  // reshape BVH treelets after building?
+  bool m_bvhStats = false;     // print BVH statistics after building?
+  bool m_shadowCache = true;   // try the last shadow ray's occluder first?
+  bool m_renderStats = false;  // print render statistics when done?
   bool m_internalReflection =
       true; // Enable reflection inside a translucent object.
   bool m_backfaceSpecular = false; // Enable specular component even seeing